@@ -9,31 +9,274 @@
 #include <iostream>
 #include <string>
 #include <iomanip>
-#include <list>
 #include <fstream>
 #include <vector>
 #include <unordered_map>
+#include <map>
 #include <sstream>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cmath>
+#include <cctype>
+#include <cstdint>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <thread>
 
 using namespace std;
 
-// Utility functions
-void loadFile(string fname, fstream& file)
-{
-    file.open(fname.c_str());
-    if (file.fail())
-    {
-        cout << "Cannot open file " << fname << endl;
+// Hot-path instrumentation of the stock market (per-order latency histograms and counters shown
+// by "print stats"); disabled by default, build with -DMARKET_STATS=1 to compile it in
+#ifndef MARKET_STATS
+#define MARKET_STATS 0
+#endif
+
+// Prices are fixed-point integers counting ticks of a configurable size, so that comparisons and
+// arithmetic on prices are exact integer operations
+typedef long long Ticks;
+
+// number of price units per currency unit; tick sizes are expressed exactly in price units
+const long long PRICE_UNITS = 1000000000LL;
+
+// tick size in price units (default: one cent)
+long long tickUnits = PRICE_UNITS / 100;
+
+// the largest magnitude of a price in ticks: orders keep their price in 32 bits (see packKey)
+const Ticks MAX_PRICE_TICKS = (1LL << 31) - 1;
+
+// INPUT: the characters [b, e) of a decimal number such as "100.69", and units (passed by ref)
+// OUTPUT: true iff the characters are exactly a decimal number (an optional sign, then digits with
+// an optional decimal point, with at least one digit) whose value fits in price units, in which
+// case units is that value; digits beyond the precision of a price unit are ignored
+bool
+parsePriceUnits(const char* b, const char* e, long long& units) {
+    bool negative = (b < e && *b == '-');
+    if (negative || (b < e && *b == '+')) b++;
+    // the largest whole number that still fits in price units with any fraction added
+    const long long maxWhole = INT64_MAX / PRICE_UNITS - 1;
+    long long whole = 0;
+    int digits = 0;
+    for (; b < e && isdigit((unsigned char) *b); b++, digits++) {
+        whole = whole * 10 + (*b - '0');
+        if (whole > maxWhole) return false;
+    }
+    units = whole * PRICE_UNITS;
+    if (b < e && *b == '.') {
+        long long scale = PRICE_UNITS / 10;
+        for (b++; b < e && isdigit((unsigned char) *b); b++, digits++, scale /= 10)
+            units += (*b - '0') * scale;
+    }
+    if (b != e || digits == 0) return false;
+    if (negative) units = -units;
+    return true;
+}
+
+bool
+parsePriceUnits(const string& s, long long& units) {
+    return parsePriceUnits(s.data(), s.data() + s.size(), units);
+}
+
+// INPUT: the characters [b, e) of a decimal price, and price (passed by ref)
+// OUTPUT: true iff the characters are a valid decimal number (see parsePriceUnits) whose value,
+// rounded to the nearest tick, is at most MAX_PRICE_TICKS in magnitude, in which case price is
+// that value in ticks
+bool
+parsePrice(const char* b, const char* e, Ticks& price) {
+    long long units;
+    if (!parsePriceUnits(b, e, units)) return false;
+    if (units < 0) price = -((-units + tickUnits / 2) / tickUnits);
+    else price = (units + tickUnits / 2) / tickUnits;
+    return (price <= MAX_PRICE_TICKS && price >= -MAX_PRICE_TICKS);
+}
+
+bool
+parsePrice(const string& s, Ticks& price) {
+    return parsePrice(s.data(), s.data() + s.size(), price);
+}
+
+// INPUT: a price p in currency units
+// OUTPUT: the price in ticks, rounded to the nearest tick
+Ticks
+priceToTicks(double p) {
+    return llround(p * PRICE_UNITS / tickUnits);
+}
+
+// INPUT: an amount t in ticks
+// OUTPUT: the amount in currency units (used only for output)
+double
+ticksToPrice(Ticks t) {
+    return t * ((double) tickUnits / PRICE_UNITS);
+}
+
+// the price, in currency units, that every tick size must be able to represent: MAX_PRICE_TICKS
+// ticks must reach it, so the smallest tick size allowed is about 0.0000466
+const long long MIN_PRICE_RANGE = 100000;
+
+// INPUT: a decimal tick size string s such as "0.01"
+// OUTPUT: true iff s is a valid (positive) tick size with which prices up to MIN_PRICE_RANGE can
+// be represented, in which case it becomes the tick size
+bool
+setTickSize(const string& s) {
+    long long units;
+    if (!parsePriceUnits(s, units) || units <= 0) return false;
+    if (units < (MIN_PRICE_RANGE * PRICE_UNITS + MAX_PRICE_TICKS - 1) / MAX_PRICE_TICKS) return false;
+    tickUnits = units;
+    return true;
+}
+
+// Buffered output used for all the market's printing
+// Text is formatted straight into a large reusable buffer, which is written out only when it is
+// full or flushed, so printing a line neither allocates nor flushes. Prices are printed the way
+// cout printed them: in the default floating-point format until the first order or element is
+// printed, and with two fixed decimals from then on (cout's format flags were sticky).
+class OutputBuffer {
+    public:
+        OutputBuffer(FILE* f = stdout, size_t capacity = 1 << 20)
+            : file(f), sink(NULL), buf(capacity), len(0), fixedPrices(false) { }
+        ~OutputBuffer() { flush(); }
+
+        void write(const char* s, size_t n);
+        void put(char c) {
+            if (len == buf.size()) flush();
+            buf[len++] = c;
+        }
+        void putInt(long long x);
+        void putPrice(Ticks t);
+        void setFixedPrices() { fixedPrices = true; }
+        void flush();
+        void redirect(FILE* f) { flush(); file = f; }
+        void capture(string* s) { flush(); sink = s; }
+
+    private:
+        FILE* file;
+        string* sink;  // if set, the output is appended here instead of written to the file
+        vector<char> buf;
+        size_t len;
+        bool fixedPrices;
+};
+
+// INPUT: n characters s
+// POSTCONDITION: s is appended to the buffer, flushing it first if there is no room
+void
+OutputBuffer::write(const char* s, size_t n) {
+    if (len + n > buf.size()) {
+        flush();
+        if (n > buf.size()) {
+            if (sink) sink->append(s, n);
+            else fwrite(s, 1, n, file);
+            return;
+        }
+    }
+    memcpy(buf.data() + len, s, n);
+    len += n;
+}
+
+// INPUT: an integer x
+// POSTCONDITION: the decimal digits of x are appended to the buffer
+void
+OutputBuffer::putInt(long long x) {
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long long u = (x < 0) ? 0ULL - (unsigned long long) x : (unsigned long long) x;
+    do {
+        digits[--i] = '0' + (char) (u % 10);
+        u /= 10;
+    } while (u);
+    if (x < 0) digits[--i] = '-';
+    write(digits + i, sizeof(digits) - i);
+}
+
+// INPUT: an amount t in ticks
+// POSTCONDITION: the amount in currency units is appended to the buffer, formatted as cout would
+void
+OutputBuffer::putPrice(Ticks t) {
+    const long long CENT_UNITS = PRICE_UNITS / 100;
+    if (fixedPrices && tickUnits % CENT_UNITS == 0) {
+        // ticks are whole cents: format exactly with integer arithmetic
+        long long cents = t * (tickUnits / CENT_UNITS);
+        if (cents < 0) {
+            put('-');
+            cents = -cents;
+        }
+        putInt(cents / 100);
+        put('.');
+        put('0' + (char) (cents % 100 / 10));
+        put('0' + (char) (cents % 10));
+        return;
+    }
+    char text[64];
+    int n = snprintf(text, sizeof(text), (fixedPrices) ? "%.2f" : "%g", ticksToPrice(t));
+    write(text, n);
+}
+
+// POSTCONDITION: the contents of the buffer are written to the file (or appended to the capture
+// string) and the buffer is emptied
+void
+OutputBuffer::flush() {
+    if (sink) {
+        sink->append(buf.data(), len);
+        len = 0;
+        return;
     }
+    if (len > 0) fwrite(buf.data(), 1, len, file);
+    len = 0;
+    fflush(file);
+}
+
+// output buffer for standard output
+OutputBuffer output;
+
+// an amount in ticks to be printed as a price
+struct Price {
+    Ticks ticks;
+    explicit Price(Ticks t) : ticks(t) { }
+};
+
+OutputBuffer&
+operator <<(OutputBuffer& out, const char* s) {
+    out.write(s, strlen(s));
+    return out;
+}
+
+OutputBuffer&
+operator <<(OutputBuffer& out, const string& s) {
+    out.write(s.data(), s.size());
+    return out;
+}
+
+OutputBuffer&
+operator <<(OutputBuffer& out, char c) {
+    out.put(c);
+    return out;
 }
 
+OutputBuffer&
+operator <<(OutputBuffer& out, int x) {
+    out.putInt(x);
+    return out;
+}
+
+OutputBuffer&
+operator <<(OutputBuffer& out, long long x) {
+    out.putInt(x);
+    return out;
+}
+
+OutputBuffer&
+operator <<(OutputBuffer& out, Price p) {
+    out.putPrice(p.ticks);
+    return out;
+}
 
 // Key structure for stock market trading
 struct Key {
-    double price;
+    Ticks price;
     int timeStamp;
-    Key() : price(0.0), timeStamp(0) { }
-    Key(double p, int t) {
+    Key() : price(0), timeStamp(0) { }
+    Key(Ticks p, int t) {
         price = p;
         timeStamp = t;
     }
@@ -49,22 +292,22 @@ operator < (const Key &x, const Key &y) {
 }
 
 // utility/aux method to print the time stamp of a key
-// INPUT: output stream out (passed by ref) and a pointer to time-structure object
+// INPUT: output buffer out (passed by ref) and a pointer to time-structure object
 // PRECONDITION: properly initialized inputs
 // POSTCONDITION: string-formatted time stamp sent to out
 void
-printTimeStamp(ostream &out, const int t) {
+printTimeStamp(OutputBuffer &out, const int t) {
     out << t;
 }
 
-// overloading output stream operator for keys
-// INPUT: output stream out and a key (both passed by ref)
-// OUTPUT: the output stream (passed by ref)
+// overloading output operator for keys
+// INPUT: output buffer out and a key (both passed by ref)
+// OUTPUT: the output buffer (passed by ref)
 // PRECONDITION: properly initialized input
 // POSTCONDITION: string-formatted key sent to out
-ostream &
-operator <<(ostream &out, const Key &k) {
-    out << "(" << k.price << ",";
+OutputBuffer &
+operator <<(OutputBuffer &out, const Key &k) {
+    out << "(" << Price(k.price) << ",";
     printTimeStamp(out, k.timeStamp);
     out << ")";
     return out;
@@ -81,874 +324,4272 @@ struct Value {
     };
 };
 
-// overloading output stream operator for values
-// INPUT: output stream out and a value (both passed by ref)
-// OUTPUT: the output stream (passed by ref)
+// overloading output operator for values
+// INPUT: output buffer out and a value (both passed by ref)
+// OUTPUT: the output buffer (passed by ref)
 // PRECONDITION: properly initialized input
 // POSTCONDITION: string-formatted value sent to out
-ostream &
-operator <<(ostream &out, const Value &v) {
+OutputBuffer &
+operator <<(OutputBuffer &out, const Value &v) {
     out << "(" << v.numShares << "," << v.traderID << ")";
     return out;
 }
 
-// Element structure used to represent elements of a node in a binary tree
-struct Elem {
-    Key* key;
-    Value* value;
-    Elem() : key(NULL), value(NULL) { }
-    Elem(Key* k, Value* v) {
-        key = k;
-        value = v;
-    }
-    Elem(Elem* e) {
-        key = e->key;
-        value = e->value;
-    }
-    void clear() {
-        if (key) delete [] key;
-        if (value) delete [] value;
-        key = NULL;
-        value = NULL;
-    }
-};
+// Packed sort key of an order: the biased price in ticks in the high 32 bits and the time stamp
+// in the low 32 bits, so that comparing two packed keys as unsigned integers orders them exactly
+// like their keys. Buy prices are already negated in the key, so the sign flip is baked in.
+typedef uint64_t PackedKey;
 
-// INPUT: two elements, x and y
-// PRECONDITION: inputs are non-NULL
-// POSTCONDITON: the data members of the inputs are swapped
-void
-swapElem(Elem* x, Elem* y) {
-    Key* key = y->key;
-    Value* value = y->value;
-    y->key = x->key;
-    y->value = x->value;
-    x->key = key;
-    x->value = value;
+// bias added to prices so that prices of at most MAX_PRICE_TICKS in magnitude (buy prices being
+// negated) map onto unsigned 32-bit values
+const long long PACKED_PRICE_BIAS = MAX_PRICE_TICKS + 1;
+
+// INPUT: a key k
+// OUTPUT: the packed sort key of k
+// PRECONDITION: the magnitude of the price of k is at most MAX_PRICE_TICKS (prices are checked as
+// they enter: parsePrice and restore) and its time stamp is non-negative
+PackedKey
+packKey(const Key& k) {
+    return ((PackedKey) (uint32_t) (k.price + PACKED_PRICE_BIAS) << 32) | (uint32_t) k.timeStamp;
 }
 
-// Overloading less-than comparison operator for elements
-// INPUT: two elements, x and y (passed by ref)
-// OUTPUT: true iff the key of x < key of y
-// PRECONDITION: input properly initialized (each element's key is non-NULL)
-bool
-operator < (const Elem& x, const Elem& y) {
-    return (*(x.key) < *(y.key));
+// INPUT: a packed sort key p
+// OUTPUT: the key packed in p
+Key
+unpackKey(PackedKey p) {
+    return Key((Ticks) (p >> 32) - PACKED_PRICE_BIAS, (int) (uint32_t) p);
 }
 
-// Overloading greater-than comparison operator for elements
-// INPUT: two elements, x and y (passed by ref)
-// OUTPUT: true iff the key of x > key of y
-// PRECONDITION: input properly initialized 
+// Order structure: a limit order stored by value in 16 bytes: its packed sort key and its value
+struct Order {
+    PackedKey sortKey;
+    Value value;
+    Order() : sortKey(0) { }
+    Order(const Key& k, const Value& v) : sortKey(packKey(k)), value(v) { }
+    Key key() const { return unpackKey(sortKey); }
+    Ticks price() const { return (Ticks) (sortKey >> 32) - PACKED_PRICE_BIAS; }
+    int timeStamp() const { return (int) (uint32_t) sortKey; }
+};
+
+// Overloading less-than comparison operator for orders
+// INPUT: two orders, x and y (passed by ref)
+// OUTPUT: true iff the key of x < key of y; a single integer comparison
 bool
-operator > (const Elem& x, const Elem& y) {
-    return (y < x);
+operator < (const Order& x, const Order& y) {
+    return (x.sortKey < y.sortKey);
 }
 
-// overloading output stream operator for elements
-// INPUT: output stream out and an element (both passed by ref)
-// OUTPUT: the output stream (passed by ref)
-// PRECONDITION: properly initialized input
-// POSTCONDITION: string-formatted element sent to out
-ostream &
-operator <<(ostream& out, const Elem& e) {
-    out << fixed << setprecision(2) << (*(e.key)) << ":" << (*(e.value)) ;
+// orders by time stamp alone, i.e. in the order they arrived
+struct TimeOrder {
+    bool operator()(const Order& x, const Order& y) const { return x.timeStamp() < y.timeStamp(); }
+};
+
+// overloading output operator for orders; same format as for elements
+// INPUT: output buffer out and an order (both passed by ref)
+// OUTPUT: the output buffer (passed by ref)
+// POSTCONDITION: string-formatted order sent to out
+OutputBuffer &
+operator <<(OutputBuffer& out, const Order& o) {
+    out.setFixedPrices();
+    out << o.key() << ":" << o.value;
     return out;
 }
 
-// Binary tree (BT) ADT
-class BT {
+static_assert(sizeof(Order) == 16, "orders are stored in 16 bytes");
+
+// Index from time stamps (or order IDs, which are time stamps) to values, in memory proportional to
+// the live entries rather than to every time stamp ever handed out
+// The entries are kept in a window of the latest time stamps, which grows at its end as new time
+// stamps come in. When less than 1/16 of the window is live, the window is compacted: it starts
+// again at the oldest live entry after which at least 1/8 of the window stays live, and the live
+// entries before that (such as an order resting far behind the market) move to a hash map. The
+// window is thus at most 16 entries per live one, and time stamps are looked up by indexing
+// unless the live ones are very sparse.
+template <class T>
+class TimeIndex {
     public:
-        // simple data structure used to create nodes for (linked-list) implementation of general BTs
-        struct Node {
-            Elem* elem;
-            Node* left;
-            Node* right;
-            Node* parent;
-            Node() : elem(NULL), left(NULL), right(NULL), parent(NULL) { }
-            Node(Elem* e, Node* l, Node* r, Node* p) {
-                elem = e;
-                left = l;
-                right = r;
-                parent = p;
-            }
-        };
+        // INPUT: the value of the time stamps without an entry
+        explicit TimeIndex(const T& noValue) : none(noValue), base(0), live(0) { }
 
-        typedef BT::Node Node;
+        // OUTPUT: the value of time stamp t; none if it has no entry
+        T get(int t) const {
+            if (t >= base) return ((size_t) (t - base) < window.size()) ? window[t - base] : none;
+            typename unordered_map<int, T>::const_iterator it = old.find(t);
+            return (it == old.end()) ? none : it->second;
+        }
+        // INPUT: a time stamp t with an entry
+        // OUTPUT: the value of t, to be changed in place (to anything but none)
+        T& at(int t) { return (t >= base) ? window[t - base] : old.find(t)->second; }
+        void set(int t, const T& x);
+        void erase(int t);
+        template <class Dead> void eraseIf(Dead dead);
+        int size() const { return live; }
 
     private:
-        void deleteAll();
-  
-    protected:
+        static const size_t MIN_WINDOW = 4096;  // smaller windows are not compacted
 
-        void printAux(const Node* w) const;
+        T none;
+        int base;  // the time stamp of window[0]
+        vector<T> window;
+        unordered_map<int, T> old;  // the entries before base
+        int live;  // the entries in the window and in old
 
-    public:
-        Node* root;
-        int n;
+        void compact();
+};
+
+// INPUT: a time stamp t (not negative) and a value x other than none
+// POSTCONDITION: x is the value of t
+template <class T>
+void
+TimeIndex<T>::set(int t, const T& x) {
+    if (t < base) {
+        pair<typename unordered_map<int, T>::iterator, bool> r = old.insert(make_pair(t, x));
+        if (r.second) live++;
+        else r.first->second = x;
+        return;
+    }
+    size_t k = t - base;
+    if (k >= window.size()) window.resize(k + 1, none);  // amortized by the vector's doubling
+    if (window[k] == none) live++;
+    window[k] = x;
+}
 
-        BT() : root(NULL), n(0) { };
-        ~BT();
+// INPUT: a time stamp t
+// POSTCONDITION: t has no entry; the window is compacted if it is mostly dead
+template <class T>
+void
+TimeIndex<T>::erase(int t) {
+    if (t < base) live -= (int) old.erase(t);
+    else if ((size_t) (t - base) < window.size() && !(window[t - base] == none)) {
+        window[t - base] = none;
+        live--;
+    }
+    if (window.size() >= MIN_WINDOW && 16 * (size_t) live < window.size()) compact();
+}
 
-        void makeChild(Node* c, Node* p, bool isLeftChild);
-        Node* firstLeftAncestor(Node* w);
-        Node* lastLeftDescendant(Node* w);
-        Node* firstRightAncestor(Node* w);
-        Node* lastRightDescendant(Node* w);
+// INPUT: a function object telling whether the entry of a time stamp is dead, given the time stamp
+// and its value
+// POSTCONDITION: the dead entries are erased, and the window is compacted if it is mostly dead
+template <class T>
+template <class Dead>
+void
+TimeIndex<T>::eraseIf(Dead dead) {
+    for (size_t k = 0; k < window.size(); k++) {
+        if (!(window[k] == none) && dead(base + (int) k, window[k])) {
+            window[k] = none;
+            live--;
+        }
+    }
+    for (typename unordered_map<int, T>::iterator it = old.begin(); it != old.end(); ) {
+        if (dead(it->first, it->second)) {
+            it = old.erase(it);
+            live--;
+        }
+        else ++it;
+    }
+    if (window.size() >= MIN_WINDOW && 16 * (size_t) live < window.size()) compact();
+}
 
-        Node* youngestDescendantType(Node* w, bool check_left) const;
-        Node* youngestAncestorType(Node* w, bool check_left) const;
+// POSTCONDITION: the window starts at its first live entry after which at least 1/8 of it is live
+// (or past its end, if none is), and the live entries before that are moved to the hash map; this
+// is O(window), and a window is only compacted again after at least 1/16 of its new size in changes
+template <class T>
+void
+TimeIndex<T>::compact() {
+    int inWindow = live - (int) old.size();
+    size_t k = 0;
+    for (; k < window.size(); k++) {
+        if (window[k] == none) continue;
+        if (window.size() - k <= 8 * (size_t) inWindow) break;
+        old.insert(make_pair(base + (int) k, window[k]));
+        inWindow--;
+    }
+    vector<T> kept(window.begin() + k, window.end());
+    window.swap(kept);
+    base += (int) k;
+}
 
-        Node* minChild(Node* w);
-        Elem* removeNode(Node* z);
-        int size() { return n; }
-        bool empty() { return (n == 0); }
-        void print() const;
-        void printTree(Node* s, int space) const;
+// Priority queue ADT for limit orders; the order with the lowest key has the highest priority
+class PriorityQueue
+{
+public:
+    virtual ~PriorityQueue() { }
 
-        void swapElem(Node* w, Node* z);
-  
+    virtual void insert(const Order& o) = 0;
+    virtual Order* min() = 0;
+    virtual void removeMin() = 0;
+    virtual Order* find(int timeStamp) = 0;
+    virtual bool remove(int timeStamp) = 0;
+    virtual int size() const = 0;
+    virtual bool empty() const = 0;
+    virtual int available(Ticks limit, int num) const = 0;
+    virtual void collect(Ticks limit, vector<Order>& out) const = 0;
+    virtual void load(const vector<Order>& orders) = 0;
+    virtual void print() const = 0;
 };
 
-// INPUT: a pair of nodes w and z in the BT
-// PRECONDITION: w and z non-NULL
-// POSTCONDITION: w and z swap their elements
-void 
-BT::swapElem(Node* w, Node* z) {
-  Elem* tmp = w->elem;
-  w->elem = z->elem;
-  z->elem = tmp;
-}
+// Array-based heap implementation of a priority queue ADT
+// The complete binary tree is stored implicitly in level order in a contiguous array: the
+// children of the node at index i are at indices 2i+1 and 2i+2, and its parent is at index (i-1)/2.
+class ArrayHeap : public PriorityQueue
+{
+public:
+    ArrayHeap() : pos(-1) { }
 
-// utility/aux function to print out a parenthetic string representation of a BT
-// INPUT: a node w in the BT whose subtree is to be printed out; or NULL
-// PRECONDITION: w has been properly initialized (non-NULL element)
-void
-BT::printAux(const Node* w) const {
-    if (w) {
-        cout << "[";
-        cout << (*(w->elem));
-        cout << "]";
-        cout << "(";
-        printAux(w->left);
-        cout << "),(";
-        printAux(w->right);
-        cout << ")";
+    void insert(const Order& o);
+    Order* min();
+    void removeMin();
+    Order* find(int timeStamp);
+    bool remove(int timeStamp);
+    int size() const { return (int) A.size(); }
+    bool empty() const { return A.empty(); }
+    void reserve(int n) { A.reserve(n); }
+    int available(Ticks limit, int num) const { return availableFrom(0, limit, num); }
+    int availableFrom(int i, Ticks limit, int num) const;
+    void collect(Ticks limit, vector<Order>& out) const { collectFrom(0, limit, out); }
+    void collectFrom(int i, Ticks limit, vector<Order>& out) const;
+    void load(const vector<Order>& orders);
+    void print() const { printTree(0, 0); }
+    void printTree(int i, int space) const;
+
+private:
+    vector<Order> A;
+    TimeIndex<int> pos;  // index in A of the order with each time stamp; -1 if not in the heap
+
+    void place(int i, const Order& o) {
+        A[i] = o;
+        pos.at(o.timeStamp()) = i;
     }
-}
+    int minChild(int i) const;
+    void upHeapBubbling(int i);
+    void downHeapBubbling(int i);
+};
 
-// print out a parenthetic string representation of the whole BT
+// INPUT: an order o to be inserted in the heap
+// POSTCONDITION: a proper heap (after the insertion of o); the size of the heap increases by 1
 void
-BT::print() const {
-    printAux(root);
-    cout << endl;
+ArrayHeap::insert(const Order& o) {
+    A.push_back(o);
+    pos.set(o.timeStamp(), size() - 1);
+    upHeapBubbling(size() - 1);
+}
+
+// OUTPUT: the minimum (highest priority) order of the heap; NULL if the heap is empty
+Order*
+ArrayHeap::min() {
+    return (A.empty()) ? NULL : &A[0];
 }
 
-// prints out a string representation of the whole BST using a reverse inorder traversal
+// POSTCONDITION: the minimum order is removed from the heap; the last order is moved to the
+// root and a down-heap bubbling operation is performed to maintain the heap-order property
 void
-BT::printTree(Node* s, int space) const {
-    int addSpace = 8;
-    // base case
-    if (!s)
-    {
-        return;
-    }
-    // add more whitespace
-    space = space + addSpace;
-    // print right
-    this->printTree(s->right, space);
+ArrayHeap::removeMin() {
+    if (A.empty()) return;
+    remove(A[0].timeStamp());
+}
 
-    cout << endl;
-    for (int i = addSpace; i < space; i++)
-        cout << " ";
-    cout << *s->elem << endl;
+// INPUT: the time stamp of an order
+// OUTPUT: the order in the heap with that time stamp; NULL if there is none
+Order*
+ArrayHeap::find(int timeStamp) {
+    int i = pos.get(timeStamp);
+    return (i < 0) ? NULL : &A[i];
+}
 
-    // print left
-    this->printTree(s->left, space);
+// INPUT: the time stamp of an order
+// OUTPUT: true iff an order with that time stamp was in the heap
+// POSTCONDITION: the order is removed; the last order takes its place and is bubbled up or down
+// to maintain the heap-order property, so removal is O(log n)
+bool
+ArrayHeap::remove(int timeStamp) {
+    int i = pos.get(timeStamp);
+    if (i < 0) return false;
+    pos.erase(timeStamp);
+    Order last = A.back();
+    A.pop_back();
+    if (i == size()) return true;
+    place(i, last);
+    if (i > 0 && last < A[(i - 1) / 2]) upHeapBubbling(i);
+    else downHeapBubbling(i);
+    return true;
 }
 
-// INPUT: w, a node in the BT
-// OUTPUT: e, the element of w
-// PRECONDITION: the tree is not empty; and the left or right subtree, or both, of w are empty
-// POSTCONDITION: the size of the BT is reduced by 1 after w is properly removed from the BT
-Elem*
-BT::removeNode(Node* w) {
-  Elem* e = w->elem;
-  Node* z = w->parent;
-  // identify child if it exists
-  Node* x = (w->left) ? w->left : w->right;
-  makeChild(z, x, (!z) || (z->left == w));
-  if (!z) root = x;
-  n--;
-  return e;
+// INPUT: the index i of a node in the heap
+// OUTPUT: the index of the child with the lowest key; -1 if the node has no children
+int
+ArrayHeap::minChild(int i) const {
+    int n = size();
+    int l = 2 * i + 1;
+    int r = l + 1;
+    if (l >= n) return -1;
+    if (r >= n) return l;
+    return ((A[l] < A[r]) ? l : r);
 }
 
-// POSTCONDITION: The BT is empty
+// INPUT: the index i of a node in the heap
+// POSTCONDITION: the up-heap bubbling operation is performed at node i (the last node after an insertion)
 void
-BT::deleteAll()
-{
-    Node* w = root;
-    while (w) {
-        if (!(w->left || w->right)) {
-            Node* x = w;
-            w = w->parent;
-            if (w) {
-                if (w->left == x) w->left = NULL;
-                else w->right = NULL;
-            }
-            if (x->elem) {
-                x->elem->clear();
-                delete [] x->elem;
-            }
-            delete [] x;
-            n--;
-            continue;
-        }
-        w = (w->left) ? w->left : w->right;
+ArrayHeap::upHeapBubbling(int i) {
+    Order o = A[i];
+    while (i > 0) {
+        int p = (i - 1) / 2;
+        if (!(o < A[p])) break;
+        place(i, A[p]);
+        i = p;
+    }
+    place(i, o);
+}
+
+// INPUT: the index i of a node in the heap
+// POSTCONDITION: the down-heap bubbling operation is performed at node i (the root after a removal)
+void
+ArrayHeap::downHeapBubbling(int i) {
+    Order o = A[i];
+    int c;
+    while ((c = minChild(i)) >= 0 && A[c] < o) {
+        place(i, A[c]);
+        i = c;
     }
+    place(i, o);
 }
 
-// POSTCONDITION: The BT is empty
-BT::~BT() {
-    deleteAll();
+// INPUT: the index i of a node in the heap, a key price limit and a number of shares num
+// OUTPUT: the total shares of the orders of the subtree rooted at i whose key price is at most
+// limit, counted until num is reached; by the heap-order property, the subtree of an order above
+// the limit is skipped
+int
+ArrayHeap::availableFrom(int i, Ticks limit, int num) const {
+    if (num <= 0 || i >= size() || A[i].price() > limit) return 0;
+    int total = A[i].value.numShares;
+    total += availableFrom(2 * i + 1, limit, num - total);
+    if (total < num) total += availableFrom(2 * i + 2, limit, num - total);
+    return total;
 }
 
-// INPUT: w, a node in the BT
-// OUTPUT: the child with the lowest key (if any)
-// PRECONDITION: if w has both children, then their elements are non-NULL
-BT::Node*
-BT::minChild(Node* w) {
-    if (!w) return NULL;
-    Node* wL = w->left;
-    Node* wR = w->right;
-    if (!wR) return wL;
-    if (!wL) return wR;
-    Elem* eL = wL->elem;
-    Elem* eR = wR->elem;
-    return ((*eL < *eR) ? wL : wR);
+// INPUT: orders whose time stamps are not in the heap
+// POSTCONDITION: the orders are added to the heap at once: they are appended to the array, and
+// the heap is rebuilt bottom-up by a down-heap bubbling at each internal node, from the last to the
+// root, which is O(n) in all rather than O(log n) per order
+void
+ArrayHeap::load(const vector<Order>& orders) {
+    A.reserve(A.size() + orders.size());
+    for (size_t k = 0; k < orders.size(); k++) {
+        pos.set(orders[k].timeStamp(), size());
+        A.push_back(orders[k]);
+    }
+    for (int i = size() / 2 - 1; i >= 0; i--) downHeapBubbling(i);
 }
 
-/*
-  # INPUT: a node w in the BT or NULL;
-  # ancestor type flag: True iff searching for youngest left ancestor
-  # OUTPUT: the node corresponding to the youngest right/left ancestor
-  # of w: this is the node x in the tree
-  # that is the first ancestor of w whose immediate descendant is a
-  # left/right child, depending on input type flag (said differently, the node x is the first found in the path from w to
-  # the root such that for a node z that is also an ancestor of w,
-  # thus also in that path to the root from w, and where z could be w
-  # itself, we have x.right = z or x.left = z, depending on input type flag); or NULL if w is NULL or the root
-  # node of the tree Depending on the value of the input flag
-  # (True/False), the output is the first ancestor of w that has a left/right relationship to its child that is also an ancestor of w
-*/
-BT::Node*
-BT::youngestAncestorType(BT::Node* w, bool check_left) const {
-  if (!w) return NULL;
-  BT::Node* z = w;
-  BT::Node* x = z->parent;
-  while ((x && ((check_left ? x->right : x->left) == z))) {
-    z = x;
-    x = x->parent;
-  }
-  return x;
+// INPUT: the index i of a node in the heap, a key price limit and a vector out (passed by ref)
+// POSTCONDITION: the orders of the subtree rooted at i whose key price is at most limit are
+// appended to out, in no particular order
+void
+ArrayHeap::collectFrom(int i, Ticks limit, vector<Order>& out) const {
+    if (i >= size() || A[i].price() > limit) return;
+    out.push_back(A[i]);
+    collectFrom(2 * i + 1, limit, out);
+    collectFrom(2 * i + 2, limit, out);
 }
 
-/*
-  # INPUT: a node w in the BT or NULL;
-  # descendant type flag: True iff searching for youngest left descendant
-  # OUTPUT: a node corresponding to the youngest left/right descendant
-  # of w, inclusive: this is the node x in the tree
-  # that is the last left/right descendant of w, depending on input
-  # type flag); or NULL if w is NULL Depending on the value of the input type
-  # flag (True/False), the output is the (leftmost/rightmost) node in the subtree rooted at w
-*/
-BT::Node*
-BT::youngestDescendantType(BT::Node* w, bool check_left) const {
-  if (!w) return NULL;
-  while (check_left ? w->left : w->right) 
-    w = check_left ? w->left : w->right;
-  return w;
-}
-
-// INPUT: a node w in a BT
-// OUTPUT: z = the first ancestor node (i.e., node in a path from w to the root)
-// such that w is in the left subtree of the BT rooted at z
-// PRECONDITION: w is not NULL
-BT::Node*
-BT::firstLeftAncestor(Node* w) {
-  return youngestAncestorType(w,true);
-}
-
-// INPUT: a node w in a BT
-// OUTPUT: "leftmost" node of the BT rooted at w
-// PRECONDITION: non-null w
-BT::Node*
-BT::lastLeftDescendant(Node* w) {
-  // NAME: Shreyas Babel
-  // Your code here
-  return youngestDescendantType(w, true);
-}
-
-// INPUT: a node w in a BT
-// OUTPUT: z = the first ancestor node (i.e., node in a path from w to the root)
-// such that w is the right subtree of the BT rooted at z
-// PRECONDITION: w is not NULL
-// POSTCONDITION: A pointer to the first ancestor node where w is in the right subtree of the binary tree rooted at that ancestor. NULL if no such ancestor exists (e.g., w is not in any right subtree on the path to the root).
-BT::Node*
-BT::firstRightAncestor(Node* w) {
-  // NAME: Shreyas Babel
-  // Your code here
-  return youngestAncestorType(w,false);
-}
-
-// INPUT: a node w in a BT
-// OUTPUT: "rightmost" node of the BT rooted at w
-// PRECONDITION: w is not NULL
-BT::Node*
-BT::lastRightDescendant(Node* w) {
-  return youngestDescendantType(w,false);
-}
-
-// INPUT: p, a node in the BT or NULL; c, a node in the BT or NULL; and a Boolean flag, isLeft, signaling whether c should become the left child of p
-// PRECONDITION: If p and c are not NULL, then: p and c must be valid nodes in the binary tree (BT)
-// POSTCONDITON: the corresponding child of p is set to c, depending on the input; if c is not NULL, then p becomes its parent
-void
-BT::makeChild(Node* p, Node* c, bool isLeft) {
-  if (p) {
-    if (isLeft) p->left = c;
-    else p->right = c;
-  }
-  if (c) c->parent = p;
-}
-
-// Complete Binary Tree (Complete BT) ADT
-class CompleteBT : public BT
+// prints out a string representation of the subtree rooted at index i using a reverse inorder
+// traversal
+void
+ArrayHeap::printTree(int i, int space) const {
+    int addSpace = 8;
+    // base case
+    if (i >= size())
+    {
+        return;
+    }
+    // add more whitespace
+    space = space + addSpace;
+    // print right
+    this->printTree(2 * i + 2, space);
+
+    output << '\n';
+    for (int j = addSpace; j < space; j++)
+        output << " ";
+    output << A[i] << '\n';
+
+    // print left
+    this->printTree(2 * i + 1, space);
+}
+
+// Price-level implementation of a priority queue ADT for limit orders
+// Orders are grouped by price into levels kept in a sorted map; each level holds its orders in
+// an intrusive doubly-linked FIFO queue ordered by time stamp. The best order is the head of the
+// first level, so min is O(1), and matching within a level is a walk down its queue. Queue nodes
+// are recycled through a free list, and a handle table indexed by time stamp makes find and
+// remove O(1), apart from erasing a level that becomes empty.
+class PriceLevelQueue : public PriorityQueue
 {
 public:
-    typedef BT::Node Node;
-  
-    Node* lastNode;
-    Node* add(Elem* elem);
-    Elem* remove();
+    PriceLevelQueue() : n(0), freeNodes(NULL), handles(NULL) { }
+    ~PriceLevelQueue();
+
+    void insert(const Order& o);
+    Order* min();
+    void removeMin();
+    Order* find(int timeStamp);
+    bool remove(int timeStamp);
+    int size() const { return n; }
+    bool empty() const { return (n == 0); }
+    int available(Ticks limit, int num) const;
+    void collect(Ticks limit, vector<Order>& out) const;
+    void load(const vector<Order>& orders);
+    void print() const;
 
-    CompleteBT() : lastNode(NULL) {  };
-  
 private:
-    Node* getParentOfNewLastNode();
-    Node* getNewLastNode();
-};
+    struct LevelNode;
 
-// OUTPUT: the node in the complete BT where any new node inserted would be placed
-// PRECONDITION: non-empty tree
-BT::Node*
-CompleteBT::getParentOfNewLastNode() {
-  // NAME: Shreyas Babel
-  // Your code here
-  if(!lastNode->parent) return lastNode;  // If the tree only has one node
+    // all the resting orders at a single price
+    struct Level {
+        LevelNode* head;
+        LevelNode* tail;
+        Level() : head(NULL), tail(NULL) { }
+    };
 
-  if(!lastNode->parent->right) return lastNode->parent;  // If the right child of parent does not exist
-    
-  Node* w = firstLeftAncestor(lastNode); // Find the first left ancestor of the last node
+    typedef map<Ticks, Level> LevelMap;
 
-  // If a left ancestor exists, check its right child: If the right child exists, return its leftmost descendant
-  // Otherwise, return the ancestor itself
-  if(w)
-    return (w->right) ? lastLeftDescendant(w->right) : w;
+    // node of the intrusive FIFO queue of a price level
+    struct LevelNode {
+        Order order;
+        LevelNode* prev;
+        LevelNode* next;
+        LevelMap::iterator level;
+    };
 
-  return lastLeftDescendant(root); // If no left ancestor exists, return the leftmost descendant of the root
-}
+    LevelMap levels;
+    int n;
+    LevelNode* freeNodes;
+    TimeIndex<LevelNode*> handles;  // node of the order with each time stamp; NULL if not queued
 
-// OUTPUT: the node in the BT that would become the last node of the complete BT should the last node be removed
-// PRECONDITION: tree is not empty
-BT::Node*
-CompleteBT::getNewLastNode() {
-  // NAME: Shreyas Babel
-  // Your code here
-  if(!lastNode->parent) return NULL;  // If the tree only has one node
+    LevelNode* newNode(const Order& o);
+    void deleteNode(LevelNode* w);
+    void unlink(LevelNode* w);
+};
 
-  if(lastNode == lastLeftDescendant(root)) return lastRightDescendant(root); // If the last node is the leftmost descendant of the root, the new last node will be the rightmost descendant of the root 
+// POSTCONDITION: all queue nodes, including those on the free list, are deallocated
+PriceLevelQueue::~PriceLevelQueue() {
+    for (LevelMap::iterator it = levels.begin(); it != levels.end(); ++it) {
+        LevelNode* w = it->second.head;
+        while (w) {
+            LevelNode* x = w;
+            w = w->next;
+            delete x;
+        }
+    }
+    while (freeNodes) {
+        LevelNode* x = freeNodes;
+        freeNodes = freeNodes->next;
+        delete x;
+    }
+}
 
-  if(lastNode == lastNode->parent->right) return lastNode->parent->left;  // If the last node is the right child of its parent, the new last node will be the parent's left child
+// INPUT: an order o
+// OUTPUT: a queue node holding o, taken from the free list if possible
+PriceLevelQueue::LevelNode*
+PriceLevelQueue::newNode(const Order& o) {
+    LevelNode* w = freeNodes;
+    if (w) freeNodes = w->next;
+    else w = new LevelNode;
+    w->order = o;
+    w->prev = NULL;
+    w->next = NULL;
+    return w;
+}
 
-  Node* w = firstRightAncestor(lastNode); // Find the first ancestor where the last node is in the right subtree
-  return lastRightDescendant(w->left); // Return the rightmost descendant of the left child of this ancestor
+// INPUT: a queue node w no longer linked into any level
+// POSTCONDITION: w is pushed onto the free list
+void
+PriceLevelQueue::deleteNode(LevelNode* w) {
+    w->next = freeNodes;
+    freeNodes = w;
 }
 
-// INPUT: an element e
-// OUTPUT: the new node x in the complete BT containing e
-// POSTCONDITION: x is inserted in the proper place in the complete BT and becomes its last node; if the tree was empty, then x becomes the root; the size of the tree increases by 1
-BT::Node* 
-CompleteBT::add(Elem* e) {
-  // NAME: Shreyas Babel
-  // Your code here
-  Node* node = new Node(e, NULL, NULL, NULL);
+// INPUT: an order o to be inserted in the queue
+// POSTCONDITION: o is added to the level for its price (created if needed) in time-stamp order;
+// new orders carry the latest time stamp and go to the tail, and the remainder of a partially
+// filled order carries the earliest and goes to the head, so both cases are O(1) within a level
+void
+PriceLevelQueue::insert(const Order& o) {
+    LevelMap::iterator it = levels.emplace(o.price(), Level()).first;
+    Level& level = it->second;
+    LevelNode* w = newNode(o);
+    w->level = it;
+    int t = o.timeStamp();
+    handles.set(t, w);
+    if (!level.tail) {
+        level.head = level.tail = w;
+    }
+    else if (level.tail->order.timeStamp() < t) {
+        w->prev = level.tail;
+        level.tail->next = w;
+        level.tail = w;
+    }
+    else if (t < level.head->order.timeStamp()) {
+        w->next = level.head;
+        level.head->prev = w;
+        level.head = w;
+    }
+    else {
+        LevelNode* x = level.tail;
+        while (t < x->prev->order.timeStamp()) x = x->prev;
+        w->prev = x->prev;
+        w->next = x;
+        x->prev->next = w;
+        x->prev = w;
+    }
+    n++;
+}
 
-  // If the tree is empty
-  if(empty())
-    this->root = node;
-  else{
-    Node* parent = getParentOfNewLastNode(); // get the node where the new node would be inserted, and make it the parent of the new node
-    makeChild(parent, node, !parent->left); // !parent->left here checks if the left child of the parent exists or not
-  }
-  // set the lastNode and increase the size of the tree
-  lastNode = node; 
-  n++;
-  return node;
+// OUTPUT: the minimum (highest priority) order, the head of the best level; NULL if empty
+Order*
+PriceLevelQueue::min() {
+    return (levels.empty()) ? NULL : &(levels.begin()->second.head->order);
 }
 
-// OUTPUT: the element of the last node of the complete BT (to be removed); NULL if the tree is empty
-// POSTCONDITON: the last node of the complete BT is removed from the tree and the last node is properly reset (to NULL if the tree becomes empty); the size of the tree decreases by 1
-Elem*
-CompleteBT::remove() {
-  // NAME: Shreyas Babel
-  // Your code here
-  if(empty()) return NULL;
+// POSTCONDITION: the head of the best level is removed, and the level too if it becomes empty
+void
+PriceLevelQueue::removeMin() {
+    if (levels.empty()) return;
+    unlink(levels.begin()->second.head);
+}
 
-  Node* w = lastNode;
-  lastNode = getNewLastNode(); //Update the lastNode
-  return removeNode(w);  //Remove the node
+// INPUT: the time stamp of an order
+// OUTPUT: the queued order with that time stamp; NULL if there is none
+Order*
+PriceLevelQueue::find(int timeStamp) {
+    LevelNode* w = handles.get(timeStamp);
+    return (w) ? &(w->order) : NULL;
 }
 
-// Heap data-structure implementation of a priority queue ADT
-class Heap : public CompleteBT
-{
-public:
-    typedef CompleteBT::Node Node;
-  
-    void insert(Elem* e);
-    Elem* min();
-    void removeMin();
-  
-private:
-    void upHeapBubbling();
-    void downHeapBubbling();
-};
+// INPUT: the time stamp of an order
+// OUTPUT: true iff an order with that time stamp was queued
+// POSTCONDITION: the order is unlinked from its level
+bool
+PriceLevelQueue::remove(int timeStamp) {
+    LevelNode* w = handles.get(timeStamp);
+    if (!w) return false;
+    unlink(w);
+    return true;
+}
 
-// INPUT: an element e to be inserted in the heap
-// POSTCONDITION: a proper heap (after the insertion of e); a new node containing e is added to the heap, so that the size of the heap increases by 1
+// INPUT: a queued node w
+// POSTCONDITION: w is unlinked from its level, which is erased if it becomes empty, and recycled
 void
-Heap::insert(Elem* e) {
-  // NAME: Shreyas Babel
-  // Your code here
-  add(e);           // add the node to the lastplace
-  upHeapBubbling(); // update the heap order
+PriceLevelQueue::unlink(LevelNode* w) {
+    Level& level = w->level->second;
+    if (w->prev) w->prev->next = w->next;
+    else level.head = w->next;
+    if (w->next) w->next->prev = w->prev;
+    else level.tail = w->prev;
+    if (!level.head) levels.erase(w->level);
+    handles.erase(w->order.timeStamp());
+    deleteNode(w);
+    n--;
 }
 
-// OUTPUT: the minimum (highest priority) element of the heap
-Elem*
-Heap::min() {
-  // NAME: Shreyas Babel
-  // Your code here
-  return (root) ? root->elem : NULL;  // return the first node if the tree is not empty else return NULL
+// INPUT: a key price limit and a number of shares num
+// OUTPUT: the total shares of the orders whose key price is at most limit, counted level by level
+// until num is reached
+int
+PriceLevelQueue::available(Ticks limit, int num) const {
+    int total = 0;
+    for (LevelMap::const_iterator it = levels.cbegin(); it != levels.cend() && it->first <= limit; ++it)
+        for (const LevelNode* w = it->second.head; w && total < num; w = w->next)
+            total += w->order.value.numShares;
+    return total;
 }
 
-// POSTCONDITION: the minimum (highest priority) element (i.e., the element at the root of the tree) is removed from the heap; the element of the last node is copied to the root; the last node is removed and the new last node is set; a down-heap bubbling operation is performed at the root with the new copied element to maintain the heap-order property as needed
+// INPUT: a key price limit and a vector out (passed by ref)
+// POSTCONDITION: the orders whose key price is at most limit are appended to out, in priority order
 void
-Heap::removeMin() {
-  // NAME: Shreyas Babel
-  // Your code here
-  if(!root) return;
-
-  swapElem(root, lastNode); // swap the root with lastNode
-  remove(); // remove the lastNode
-  downHeapBubbling();  // update the heap order
+PriceLevelQueue::collect(Ticks limit, vector<Order>& out) const {
+    for (LevelMap::const_iterator it = levels.cbegin(); it != levels.cend() && it->first <= limit; ++it)
+        for (const LevelNode* w = it->second.head; w; w = w->next) out.push_back(w->order);
 }
 
-// PRECONDITION: the heap is not empty
-// POSTCONDITION: the up-heap bubbling operation is performed at the last node after performing an insertion to maintain the heap-order property
+// INPUT: orders whose time stamps are not in the queue
+// POSTCONDITION: the orders are added; into an empty queue they are linked in time order (sorting
+// them first only if they are not), so that each goes straight to the tail of its level
 void
-Heap::upHeapBubbling() {
-  // NAME: Shreyas Babel
-  // Your code here
-  Node* curr = lastNode; 
-  while(curr->parent){
-    if(*(curr->elem) < *(curr->parent->elem)) swapElem(curr, curr->parent);  // if the curr->elem is less than the parent->elem then swap them
-    else break;
-    curr = curr->parent;
-  }
+PriceLevelQueue::load(const vector<Order>& orders) {
+    if (n > 0) {
+        for (size_t k = 0; k < orders.size(); k++) insert(orders[k]);
+        return;
+    }
+    // in time order every order goes to the tail of its level
+    const vector<Order>* byTime = &orders;
+    vector<Order> sorted;
+    int last = -1;
+    bool inOrder = true;
+    for (size_t k = 0; k < orders.size() && inOrder; k++) {
+        inOrder = (orders[k].timeStamp() > last);
+        last = orders[k].timeStamp();
+    }
+    if (!inOrder) {
+        sorted = orders;
+        sort(sorted.begin(), sorted.end(), TimeOrder());
+        byTime = &sorted;
+        last = sorted.back().timeStamp();
+    }
+    LevelMap::iterator it = levels.end();
+    for (size_t k = 0; k < byTime->size(); k++) {
+        const Order& o = (*byTime)[k];
+        if (it == levels.end() || it->first != o.price())
+            it = levels.emplace(o.price(), Level()).first;
+        Level& level = it->second;
+        LevelNode* w = newNode(o);
+        w->level = it;
+        handles.set(o.timeStamp(), w);
+        if (!level.tail) level.head = w;
+        else {
+            w->prev = level.tail;
+            level.tail->next = w;
+        }
+        level.tail = w;
+        n++;
+    }
 }
 
-// POSTCONDITION: the down-heap bubbling operation is performed at the root, if the heap is not empty or it has at least two nodes, after performing a removal to maintain the heap-order property
+// prints out the orders of the queue in priority order, one level at a time
 void
-Heap::downHeapBubbling() {
-  // NAME: Shreyas Babel
-  // Your code here
-  Node* curr = root;
-  while(curr){
-    Node* child = minChild(curr);   
-    if(child && *(child->elem) < *(curr->elem)){ // swap the minchild with its parent if child->elem is less than curr->elem
-        swapElem(child,curr);
-        curr = child;
+PriceLevelQueue::print() const {
+    for (LevelMap::const_iterator it = levels.cbegin(); it != levels.cend(); ++it) {
+        output << '\n';
+        for (const LevelNode* w = it->second.head; w; w = w->next)
+            output << w->order << '\n';
     }
-    else break;
-  }
 }
 
-// DO NOT CHANGE ANYTHING BELOW THIS LINE
+// Order-book engines available to the stock market
+enum Engine { HEAP_ENGINE, LEVEL_ENGINE };
 
-typedef Heap PriorityQueue;
+// INPUT: an order-book engine
+// OUTPUT: a new, empty priority queue for limit orders implemented by the given engine
+PriorityQueue*
+newPriorityQueue(Engine engine) {
+    if (engine == LEVEL_ENGINE) return new PriceLevelQueue();
+    return new ArrayHeap();
+}
+
+// Table of the interned stock symbols
+// Each symbol is mapped to a dense ID in order of first appearance, so per-symbol state is kept in
+// arrays indexed by the ID; ID 0 is the default symbol of the orders that name no symbol.
+class SymbolTable {
+    public:
+        SymbolTable() { intern(NULL, NULL); }
+        int intern(const char* b, const char* e);
+        const string& name(int symbol) const { return names[symbol]; }
+        int size() const { return (int) names.size(); }
+
+    private:
+        unordered_map<string, int> ids;
+        vector<string> names;
+        string key;  // reusable lookup key, so that looking up a known symbol does not allocate
+};
+
+// INPUT: the characters [b, e) of a symbol
+// OUTPUT: the ID of the symbol
+// POSTCONDITION: a symbol seen for the first time is given the next free ID
+int
+SymbolTable::intern(const char* b, const char* e) {
+    key.assign(b, e);
+    unordered_map<string, int>::const_iterator it = ids.find(key);
+    if (it != ids.end()) return it->second;
+    int symbol = (int) names.size();
+    ids[key] = symbol;
+    names.push_back(key);
+    return symbol;
+}
 
-// Ledger ADT for financial books/records
+// Pseudo symbol ID selecting all of the symbols
+const int ALL_SYMBOLS = -1;
+
+// Ledger ADT for financial books/records, with flat storage
+// The records are kept in one vector, in the order they are created. A trader's record for a
+// symbol is found through an open-addressing hash table, or, for a trader in the dense range of
+// IDs, first at the head of the trader's chain of records (the record of its lowest symbol), which is
+// in a table indexed by trader ID shared by all of the symbols. Each record keeps its buy and sell
+// transactions as contiguous, append-only logs of (price, time, shares) rows, so recording a trade
+// allocates nothing but the occasional growth of a log.
+// The records are printed in the order of trader ID (and symbol ID for the same trader) without
+// sorting: the records of a dense ID are chained in symbol order from a table indexed by ID, and
+// the few records of sparse IDs are also kept in an ordered map.
+// Every print is a checkpoint: the ledger keeps the list of records changed since, and how much of
+// each transaction log has been printed, so that the changes since the last print can be printed
+// in time proportional to the activity since then rather than to the whole history.
 class Ledger {
     private:
-        typedef list<Elem*> TransList;
-        // a financial record data-structure 
+        // a row of a transaction log; the trader is the owner of the log
+        struct Trade {
+            Ticks price;
+            int timeStamp;
+            int numShares;
+        };
+        typedef vector<Trade> TradeLog;
+        // a financial record data-structure
         struct Record {
             int id;
-            double balance;
+            int symbol;
+            Ticks balance;
             int holdings;
-            TransList buyTrans;
-            TransList sellTrans;
-            Record() : id(0), balance(0.0), holdings(0)  { }
-            Record(int i, double bal, int h) {
-                id = i;
-                balance = bal;
-                holdings = h;
-            }
-            void deleteTransList(TransList& L) {
-                for (TransList::const_iterator it = L.cbegin(); it != L.cend(); ++it)
-                if (*it) {
-                    Elem* e = *it;
-                    e->clear();
-                }
-                L.clear();
+            TradeLog buyTrans;
+            TradeLog sellTrans;
+            int next;  // the index of the trader's record for the next symbol (dense IDs); -1 if none
+            int printedBuys;   // the transactions printed by the last print of the record
+            int printedSells;
+            bool dirty;        // changed since the last print
+            long long position;  // shares bought less shares sold
+            Ticks cost;          // what the open position cost; negative for a short position
+            Ticks realized;      // profit and loss of the shares closed out, at average cost
+            long long bought;    // the shares bought and what they cost, for the VWAPs
+            Ticks boughtValue;
+            long long sold;
+            Ticks soldValue;
+            Record(int i, int s) : id(i), symbol(s), balance(0), holdings(0), next(-1),
+                printedBuys(0), printedSells(0), dirty(false), position(0), cost(0), realized(0),
+                bought(0), boughtValue(0), sold(0), soldValue(0) { }
+        };
+        typedef map<pair<int, int>, int> OrderedIndex;  // (trader ID, symbol ID) to record index
+
+        static const int DENSE_IDS = 1 << 20;  // trader IDs 0 .. DENSE_IDS - 1 are looked up densely
+        static const long long NO_KEY = -1;
+
+        vector<Record> records;
+        vector<int> firstRecord;  // per dense ID, the index of the trader's first record; -1 if none
+        OrderedIndex sparseOrder;  // the records of the sparse IDs
+        vector<int> dirty;  // the indexes of the records changed since their last print
+        vector<long long> hashKeys;  // linear-probing table of the records: their keys ...
+        vector<int> hashIndex;       // ... and indexes
+        int hashCount;
+        long long numTransactions;
+        // the prices the two sides of a symbol's latest fill traded at, which its positions are
+        // marked to: a long position to the price the seller got, which is what selling it would
+        // fetch, and a short one to the price the buyer paid, which is what buying it back would
+        // cost (each side settles at its own limit price, so the two differ by the bank's margin)
+        struct Mark {
+            Ticks bought;
+            Ticks sold;
+            Mark() : bought(0), sold(0) { }
+        };
+
+        vector<Mark> marks;  // per symbol ID
+
+        static long long recordKey(int id, int symbol) {
+            return ((long long) symbol << 32) | (unsigned int) id;
+        }
+        // orders record indexes by the (trader ID, symbol ID) of their records
+        struct RecordOrder {
+            const vector<Record>& records;
+            RecordOrder(const vector<Record>& r) : records(r) { }
+            bool operator()(int i, int j) const {
+                const Record& x = records[i];
+                const Record& y = records[j];
+                return (x.id != y.id) ? x.id < y.id : x.symbol < y.symbol;
             }
         };
+        // tells whether the record with an index has been printed since its last change
+        struct CleanRecord {
+            const vector<Record>& records;
+            CleanRecord(const vector<Record>& r) : records(r) { }
+            bool operator()(int i) const { return !records[i].dirty; }
+        };
+        Record& record(int id, int symbol);
+        int hashFind(long long key, int newIndex);
+        void printRecord(Record& r, const SymbolTable& symbols, bool changesOnly = false);
+        void printSparse(OrderedIndex::const_iterator& it, bool negative, const SymbolTable& symbols,
+                         int symbol);
+        void printTradeLog(const TradeLog& L, size_t from, int id) const;
+        void printPnlRecord(const Record& r, const SymbolTable& symbols) const;
 
-        typedef Ledger::Record Record;
-        void printRecord(const Record *r) const;
-        void printTransList(const TransList& L) const;
-        
     public:
-        Ledger() {};
-        ~Ledger() {
-            for (HashMap::const_iterator it = book.cbegin(); it != book.cend(); ++it)
-                if (it->second) {
-                    Record* r = it->second;	
-                    r->deleteTransList(r->buyTrans);
-                    r->deleteTransList(r->sellTrans);
-                }
-            book.clear();
-        };
-        void trans(Elem* e, bool isBuyTrans);
-        void buy(Elem* e);
-        void sell(Elem* e);
-        void print() const;
+        Ledger() : hashCount(0), numTransactions(0) { }
 
-    private:
-        typedef unordered_map<int, Record*> HashMap;
-        HashMap book;
+        void trans(const Key& k, const Value& v, bool isBuyTrans, int symbol = 0);
+        void buy(const Key& k, const Value& v, int symbol = 0);
+        void sell(const Key& k, const Value& v, int symbol = 0);
+        void print(const SymbolTable& symbols, int symbol = ALL_SYMBOLS);
+        void printChanges(const SymbolTable& symbols, int symbol = ALL_SYMBOLS);
+        void printPnl(const SymbolTable& symbols, bool all, int id = 0) const;
+        void printStorage() const;
+        size_t bytes() const;
 };
 
-void
-Ledger::printTransList(const TransList& L) const {
-    cout << "(";
-    TransList::const_iterator it = L.cbegin();
-    if (it != L.cend()) {
-        cout << *(*it);
-        for (++it; it != L.cend(); ++it)
-            cout << "," << (*(*it));
-    }
-    cout << ")";
-}
+// definitions of the constants that are passed by reference
+const int Ledger::DENSE_IDS;
+const long long Ledger::NO_KEY;
 
-void
-Ledger::printRecord(const Record* r) const {
-    cout << r->id << ":" << r->balance << ":" << r->holdings << ":";
-    printTransList(r->buyTrans);
-    cout << ":";
-    printTransList(r->sellTrans);
+// INPUT: a record key and the index a new record would get
+// OUTPUT: the index of the record with the key in the hash table; if there is none, newIndex is
+// entered for the key and returned
+int
+Ledger::hashFind(long long key, int newIndex) {
+    if (2 * (hashCount + 1) > (int) hashKeys.size()) {
+        // grow to keep the load factor at most 1/2
+        vector<long long> keys(max((size_t) 16, 2 * hashKeys.size()), NO_KEY);
+        vector<int> index(keys.size());
+        size_t mask = keys.size() - 1;
+        for (size_t i = 0; i < hashKeys.size(); i++) {
+            if (hashKeys[i] == NO_KEY) continue;
+            size_t j = (size_t) ((unsigned long long) hashKeys[i] * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+            while (keys[j] != NO_KEY) j = (j + 1) & mask;
+            keys[j] = hashKeys[i];
+            index[j] = hashIndex[i];
+        }
+        hashKeys.swap(keys);
+        hashIndex.swap(index);
+    }
+    size_t mask = hashKeys.size() - 1;
+    size_t j = (size_t) ((unsigned long long) key * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+    while (hashKeys[j] != NO_KEY) {
+        if (hashKeys[j] == key) return hashIndex[j];
+        j = (j + 1) & mask;
+    }
+    hashKeys[j] = key;
+    hashIndex[j] = newIndex;
+    hashCount++;
+    return newIndex;
 }
 
-void 
-Ledger::print() const {
-    for (HashMap::const_iterator it = book.cbegin(); it != book.cend(); ++it) {
-        printRecord(it->second);
-        cout << endl;  // cannot modify *it
+// INPUT: a trader ID and a symbol ID
+// OUTPUT: the trader's record for the symbol, which is created if this is the trader's first
+// transaction in the symbol
+Ledger::Record&
+Ledger::record(int id, int symbol) {
+    int newIndex = (int) records.size();
+    if (id >= 0 && id < DENSE_IDS) {
+        if (id >= (int) firstRecord.size()) firstRecord.resize(max(id + 1, 2 * (int) firstRecord.size()), -1);
+        int i = firstRecord[id];
+        if (i >= 0 && records[i].symbol == symbol) return records[i];  // most traders trade one symbol
+        i = hashFind(recordKey(id, symbol), newIndex);
+        if (i != newIndex) return records[i];
+        records.push_back(Record(id, symbol));
+        // link the record into the trader's chain, which is in symbol order
+        int prev = -1;  // the record the new one follows; -1 for the head of the chain
+        for (i = firstRecord[id]; i >= 0 && records[i].symbol < symbol; i = records[i].next) prev = i;
+        records[newIndex].next = i;
+        if (prev < 0) firstRecord[id] = newIndex;
+        else records[prev].next = newIndex;
+        return records[newIndex];
     }
+    int i = hashFind(recordKey(id, symbol), newIndex);
+    if (i == newIndex) {
+        records.push_back(Record(id, symbol));
+        sparseOrder[make_pair(id, symbol)] = i;
+    }
+    return records[i];
 }
 
-// INPUT: an element e and a Boolean flag signaling whether e corresponds to a buy transaction
-// PRECONDITION: e is non-NULL, as are its key and value
-// POSTCONDITION: the transaction is inserted into the ledger/book for the corresponding trader, and the trader record is updated (i.e., the trader's holdings/num of shares and balance/amount of money made or lost in all of the trader's transactions); the record for a new trader is created, and properly initialized, if this is the first transaction for the trader
 void
-Ledger::trans(Elem* e, bool isBuyTrans) {
-    double price = e->key->price;
-    int num = e->value->numShares;
-    int id = e->value->traderID;
-    Record* record = book[id];
-    if (!record) {
-        book[id] = new Record(id,0.0,0);
-        record = book[id];
+Ledger::printTradeLog(const TradeLog& L, size_t from, int id) const {
+    // as for elements, prices are fixed to two decimals from the first transaction on
+    if (L.size() > from) output.setFixedPrices();
+    output << "(";
+    for (size_t i = from; i < L.size(); i++) {
+        if (i > from) output << ",";
+        output << Key(L[i].price, L[i].timeStamp) << ":" << Value(L[i].numShares, id);
     }
-    record->holdings += num;
-    record->balance += num * price;
-    if (isBuyTrans) record->buyTrans.push_back(e);
-    else record->sellTrans.push_back(e);
+    output << ")";
 }
 
-// INPUT: an element e
-// POSTCONDITION: a buy transaction is inserted into the ledger/book for the corresponding trader, and the trader record is updated to increase the trader's holdings by the number of shares bought and reduce the trader's balance by the amount of money the trader paid for the shares; if this is the first transaction for the trader, a new record is created, and properly initialized
+// INPUT: a record r, the table of symbols and whether to print only the transactions since the
+// last print of r
+// POSTCONDITION: r is printed and marked as printed
 void
-Ledger::buy(Elem* e) {
-    trans(e,true);
+Ledger::printRecord(Record& r, const SymbolTable& symbols, bool changesOnly) {
+    output << r.id << ":";
+    if (r.symbol != 0) output << symbols.name(r.symbol) << ":";
+    output << Price(r.balance) << ":" << r.holdings << ":";
+    printTradeLog(r.buyTrans, (changesOnly) ? r.printedBuys : 0, r.id);
+    output << ":";
+    printTradeLog(r.sellTrans, (changesOnly) ? r.printedSells : 0, r.id);
+    output << '\n';
+    r.printedBuys = (int) r.buyTrans.size();
+    r.printedSells = (int) r.sellTrans.size();
+    r.dirty = false;
 }
 
-// INPUT: an element e
-// POSTCONDITION: a sell transaction is inserted into the ledger/book for the corresponding trader, and the trader record is updated to reduce its holdings by the number of shares sold and increase the trader's balance by the amount of money the trader obtained for the shares; if this is the first transaction for the trader, a new record is created, and properly initialized
+// INPUT: a position it (passed by ref) in the ordered index of the sparse IDs, whether to print the
+// negative IDs or the rest, the table of symbols and a symbol ID, or ALL_SYMBOLS
+// POSTCONDITION: the records of the symbol from it on with a negative (or a non-negative) ID are
+// printed, and it is moved past them
 void
-Ledger::sell(Elem* e) {
-    trans(e,false);
+Ledger::printSparse(OrderedIndex::const_iterator& it, bool negative, const SymbolTable& symbols,
+                    int symbol) {
+    for (; it != sparseOrder.end() && (it->first.first < 0) == negative; ++it) {
+        Record& r = records[it->second];
+        if (symbol == ALL_SYMBOLS || r.symbol == symbol) printRecord(r, symbols);
+    }
 }
 
-// Stock Market ADT
-class StockMarket {
-    private:
-        PriorityQueue buyOrders;
-        PriorityQueue sellOrders;
-        Ledger books;
-        double bank;
-        int counter = 0;
-
-        void processTrade();
-        void trade();
-        void transAux(int num, double price, int id, int t, bool buyTrans);
-        void buyAux(int num, double price, int id, int t);
-        void sellAux(int num, double price, int id, int t);
-
-    public:
-        StockMarket() : bank(0.0) { };
-  
-        void buy(double price, int num, int id);
-        void sell(double price, int num, int id);
-
-        void print();
-        void printBuy();
-        void printSell();
-        void printLedger();
-        void printBank();
-};
-
+// INPUT: the table of symbols and a symbol ID, or ALL_SYMBOLS
+// POSTCONDITION: the records of the symbol (or of all of the symbols) are printed in the order of
+// trader ID, and of symbol ID for the same trader, in time linear in the number of records and
+// dense IDs (whatever the symbol); the print is the new checkpoint of the printed records
 void
-StockMarket::printBuy() {
-    cout << "*** Buy Limit Orders ***" << endl;
-    buyOrders.printTree(buyOrders.root, 0);
+Ledger::print(const SymbolTable& symbols, int symbol) {
+    OrderedIndex::const_iterator it = sparseOrder.begin();
+    printSparse(it, true, symbols, symbol);
+    for (size_t id = 0; id < firstRecord.size(); id++)
+        for (int i = firstRecord[id]; i >= 0; i = records[i].next)
+            if (symbol == ALL_SYMBOLS || records[i].symbol == symbol) printRecord(records[i], symbols);
+    printSparse(it, false, symbols, symbol);
+    dirty.erase(remove_if(dirty.begin(), dirty.end(), CleanRecord(records)), dirty.end());
 }
 
+// INPUT: the table of symbols and a symbol ID, or ALL_SYMBOLS
+// POSTCONDITION: the records of the symbol (or of all of the symbols) changed since their last
+// print are printed in the order of trader ID, and of symbol ID for the same trader, with only
+// their new transactions (and their current balance and holdings); it takes time proportional to
+// the changes, and the print is the new checkpoint of the printed records
 void
-StockMarket::printSell() {
-    cout << "*** Sell Limit Orders ***" << endl;
-    sellOrders.printTree(sellOrders.root, 0);
+Ledger::printChanges(const SymbolTable& symbols, int symbol) {
+    sort(dirty.begin(), dirty.end(), RecordOrder(records));
+    for (size_t k = 0; k < dirty.size(); k++) {
+        Record& r = records[dirty[k]];
+        if (symbol == ALL_SYMBOLS || r.symbol == symbol) printRecord(r, symbols, true);
+    }
+    dirty.erase(remove_if(dirty.begin(), dirty.end(), CleanRecord(records)), dirty.end());
 }
 
+// INPUT: an amount a in ticks and a nonzero number of shares n
+// OUTPUT: the amount per share, rounded to the nearest tick, with halves rounded away from zero
+Ticks
+perShare(Ticks a, long long n) {
+    if (n < 0) {
+        a = -a;
+        n = -n;
+    }
+    Ticks q = a / n;
+    Ticks rem = (a < 0) ? -(a % n) : a % n;
+    if (rem >= n - rem) q += (a < 0) ? -1 : 1;
+    return q;
+}
+
+// INPUT: a record r and the table of symbols
+// POSTCONDITION: the profit and loss of r is printed as
+// <id>:[<symbol>:]<position>:<average cost>:<realized>:<unrealized>:<buy VWAP>:<sell VWAP>, where
+// the unrealized profit and loss marks the open position to the symbol's latest fill (see Mark); the
+// average cost and the VWAPs are rounded to the nearest tick (see perShare), and are 0 with no shares
+// to average over
+void
+Ledger::printPnlRecord(const Record& r, const SymbolTable& symbols) const {
+    const Mark& m = marks[r.symbol];  // there is a mark for every symbol with a record
+    Ticks mark = (r.position > 0) ? m.sold : m.bought;
+    output.setFixedPrices();
+    output << r.id << ":";
+    if (r.symbol != 0) output << symbols.name(r.symbol) << ":";
+    output << r.position << ":" << Price((r.position != 0) ? perShare(r.cost, r.position) : 0) << ":"
+           << Price(r.realized) << ":" << Price(r.position * mark - r.cost) << ":"
+           << Price((r.bought > 0) ? perShare(r.boughtValue, r.bought) : 0) << ":"
+           << Price((r.sold > 0) ? perShare(r.soldValue, r.sold) : 0) << '\n';
+}
+
+// INPUT: the table of symbols, whether to print every trader, and otherwise a trader ID
+// POSTCONDITION: the profit and loss of each record of the trader (or of every trader) is printed
+// in the order of trader ID, and of symbol ID for the same trader, from the statistics kept by
+// trans, in O(1) per record whatever the number of transactions
+void
+Ledger::printPnl(const SymbolTable& symbols, bool all, int id) const {
+    OrderedIndex::const_iterator it =
+        (all) ? sparseOrder.begin() : sparseOrder.lower_bound(make_pair(id, 0));
+    for (; it != sparseOrder.end() && it->first.first < 0 && (all || it->first.first == id); ++it)
+        printPnlRecord(records[it->second], symbols);
+    for (size_t k = (all) ? 0 : id; k < firstRecord.size() && (all || (int) k == id); k++)
+        for (int i = firstRecord[k]; i >= 0; i = records[i].next) printPnlRecord(records[i], symbols);
+    for (; it != sparseOrder.end() && (all || it->first.first == id); ++it)
+        printPnlRecord(records[it->second], symbols);
+}
+
+// OUTPUT: the number of bytes held by the ledger's storage
+size_t
+Ledger::bytes() const {
+    size_t n = records.capacity() * sizeof(Record) + firstRecord.capacity() * sizeof(int)
+        + hashKeys.capacity() * sizeof(long long) + hashIndex.capacity() * sizeof(int)
+        + dirty.capacity() * sizeof(int) + marks.capacity() * sizeof(Mark);
+    // a map node holds three links, a color and the entry
+    n += sparseOrder.size() * (4 * sizeof(void*) + sizeof(OrderedIndex::value_type));
+    for (size_t i = 0; i < records.size(); i++)
+        n += (records[i].buyTrans.capacity() + records[i].sellTrans.capacity()) * sizeof(Trade);
+    return n;
+}
+
+// POSTCONDITION: the number of records and transactions and the bytes held are printed
+void
+Ledger::printStorage() const {
+    output << "records: " << (long long) records.size() << ", transactions: " << numTransactions
+           << ", bytes: " << (long long) bytes() << '\n';
+}
+
+// INPUT: the key and value of a transaction, a Boolean flag signaling whether it is a buy transaction, and the ID of the traded symbol
+// POSTCONDITION: the transaction is appended to the log of the corresponding trader and symbol, and the trader record is updated (i.e., the trader's holdings/num of shares and balance/amount of money made or lost in all of the trader's transactions); the record for a new trader is created, and properly initialized, if this is the first transaction for the trader
+void
+Ledger::trans(const Key& k, const Value& v, bool isBuyTrans, int symbol) {
+    Record& r = record(v.traderID, symbol);
+    if (!r.dirty) {
+        r.dirty = true;
+        dirty.push_back((int) (&r - &records[0]));
+    }
+    r.holdings += v.numShares;
+    r.balance += v.numShares * k.price;
+
+    // the profit and loss statistics, at average cost: a trade that adds to the position (or
+    // opens one) adds to its cost, and one against it closes out shares at their share of the
+    // cost, realizing the difference, before opening a position the other way with the rest
+    Ticks price = (isBuyTrans) ? -k.price : k.price;
+    long long shares = (isBuyTrans) ? v.numShares : -v.numShares;
+    if (symbol >= (int) marks.size()) marks.resize(symbol + 1);
+    if (isBuyTrans) {
+        r.bought += v.numShares;
+        r.boughtValue += v.numShares * price;
+        marks[symbol].bought = price;
+    }
+    else {
+        r.sold += v.numShares;
+        r.soldValue += v.numShares * price;
+        marks[symbol].sold = price;
+    }
+    if (r.position != 0 && (r.position > 0) != (shares > 0)) {
+        long long open = (r.position > 0) ? r.position : -r.position;
+        long long closed = min(open, (long long) v.numShares);
+        Ticks closedCost = (Ticks) ((__int128) r.cost * closed / open);
+        r.realized += ((r.position > 0) ? closed : -closed) * price - closedCost;
+        r.cost -= closedCost;
+        r.position += (r.position > 0) ? -closed : closed;
+        shares += (shares > 0) ? -closed : closed;
+    }
+    r.position += shares;
+    r.cost += shares * price;
+
+    Trade t = { k.price, k.timeStamp, v.numShares };
+    if (isBuyTrans) r.buyTrans.push_back(t);
+    else r.sellTrans.push_back(t);
+    numTransactions++;
+}
+
+// INPUT: the key and value of a buy transaction and the ID of the traded symbol
+// POSTCONDITION: a buy transaction is inserted into the ledger/book for the corresponding trader, and the trader record is updated to increase the trader's holdings by the number of shares bought and reduce the trader's balance by the amount of money the trader paid for the shares; if this is the first transaction for the trader, a new record is created, and properly initialized
+void
+Ledger::buy(const Key& k, const Value& v, int symbol) {
+    trans(k, v, true, symbol);
+}
+
+// INPUT: the key and value of a sell transaction and the ID of the traded symbol
+// POSTCONDITION: a sell transaction is inserted into the ledger/book for the corresponding trader, and the trader record is updated to reduce its holdings by the number of shares sold and increase the trader's balance by the amount of money the trader obtained for the shares; if this is the first transaction for the trader, a new record is created, and properly initialized
+void
+Ledger::sell(const Key& k, const Value& v, int symbol) {
+    trans(k, v, false, symbol);
+}
+
+// Log-linear histogram of non-negative integer samples (HDR-style)
+// Values below 16 have a bucket each; above that every power of two is split into 16 linear
+// sub-buckets, so any recorded value is known to within 1/16 (about 6%) of its magnitude.
+class Histogram {
+    private:
+        static const int SUB_BITS = 4;
+        static const int SUB_COUNT = 1 << SUB_BITS;
+
+        vector<long long> counts;
+        long long total;
+        long long maxValue;
+
+        static int bucketOf(unsigned long long v);
+        static unsigned long long bucketHigh(int i);
+
+    public:
+        Histogram() : counts((64 - SUB_BITS + 1) * SUB_COUNT, 0), total(0), maxValue(0) { }
+
+        void record(long long v);
+        long long count() const { return total; }
+        long long max() const { return maxValue; }
+        long long percentile(double q) const;
+        void print(const char* name) const;
+};
+
+// INPUT: a value v
+// OUTPUT: the index of the bucket of v
+int
+Histogram::bucketOf(unsigned long long v) {
+    if (v < (unsigned long long) SUB_COUNT) return (int) v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - SUB_BITS + 1) * SUB_COUNT + (int) ((v >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// INPUT: the index i of a bucket
+// OUTPUT: the largest value that falls in bucket i
+unsigned long long
+Histogram::bucketHigh(int i) {
+    if (i < SUB_COUNT) return i;
+    int e = i / SUB_COUNT + SUB_BITS - 1;
+    unsigned long long low = (unsigned long long) (SUB_COUNT + i % SUB_COUNT) << (e - SUB_BITS);
+    return low + (1ULL << (e - SUB_BITS)) - 1;
+}
+
+// INPUT: a sample v (negative samples are recorded as 0)
+// POSTCONDITION: v is counted in its bucket
+void
+Histogram::record(long long v) {
+    if (v < 0) v = 0;
+    counts[bucketOf(v)]++;
+    total++;
+    if (v > maxValue) maxValue = v;
+}
+
+// INPUT: a fraction q in [0, 1]
+// OUTPUT: the q-quantile of the samples, as the upper end of its bucket (at most the maximum)
+long long
+Histogram::percentile(double q) const {
+    if (total == 0) return 0;
+    long long rank = (long long) (q * total);
+    if (rank >= total) rank = total - 1;
+    long long seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen > rank) {
+            long long high = (long long) bucketHigh((int) i);
+            return (high < maxValue) ? high : maxValue;
+        }
+    }
+    return maxValue;
+}
+
+// INPUT: the name of the histogram
+// POSTCONDITION: the sample count, percentiles and maximum are sent to the output
+void
+Histogram::print(const char* name) const {
+    output << name << ": n=" << total << " p50=" << percentile(0.5) << " p90=" << percentile(0.9)
+           << " p99=" << percentile(0.99) << " p99.9=" << percentile(0.999) << " max=" << maxValue << '\n';
+}
+
+// Statistics collected on the stock market's hot path
+struct MarketStats {
+    Histogram totalNs;    // latency of an order, from arrival until all its fills are recorded
+    Histogram insertNs;   // resting what is left of the order in its limit-order book
+    Histogram matchNs;    // matching against the opposite book, excluding ledger updates
+    Histogram ledgerNs;   // recording fills in the ledger
+    Histogram fills;      // fills per aggressive order
+    Histogram heapDepth;  // depth of the book the order was inserted into
+    long long numFills;
+    long long partialFills;  // fills that left the resting order in place with fewer shares
+
+    // per-order accumulators
+    long long orderLedgerNs;
+    int orderFills;
+
+    MarketStats() : numFills(0), partialFills(0), orderLedgerNs(0), orderFills(0) { }
+    void print() const;
+};
+
+// OUTPUT: the current time of the statistics clock, in nanoseconds
+long long
+statsClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// POSTCONDITION: the latency percentiles and counters are sent to the output
+void
+MarketStats::print() const {
+    totalNs.print("order ns");
+    insertNs.print("insert ns");
+    matchNs.print("match ns");
+    ledgerNs.print("ledger ns");
+    fills.print("fills per order");
+    heapDepth.print("heap depth");
+    output << "fills: " << numFills << '\n';
+    output << "partial fills (in place, no re-insert): " << partialFills << '\n';
+}
+
+// Bounded lock-free single-producer single-consumer ring buffer
+// One thread pushes and one thread pops; each side owns one index and publishes it with a release
+// store, and keeps a cached copy of the other side's index so that it only touches the other
+// side's cache line when the ring looks full (or empty).
+template <typename T>
+class SpscRing {
+    public:
+        // INPUT: the log2 of the capacity of the ring
+        explicit SpscRing(int capacityLog2 = 12)
+            : slots((size_t) 1 << capacityLog2), mask(((size_t) 1 << capacityLog2) - 1),
+              head(0), cachedTail(0), tail(0), cachedHead(0) { }
+
+        // producer side
+        // OUTPUT: false iff the ring is full
+        bool push(const T& x) {
+            size_t t = tail.load(memory_order_relaxed);
+            if (t - cachedHead > mask) {
+                cachedHead = head.load(memory_order_acquire);
+                if (t - cachedHead > mask) return false;
+            }
+            slots[t & mask] = x;
+            tail.store(t + 1, memory_order_release);
+            return true;
+        }
+
+        // consumer side
+        // OUTPUT: the oldest element, NULL if the ring is empty; it stays in the ring until pop()
+        T* front() {
+            size_t h = head.load(memory_order_relaxed);
+            if (h == cachedTail) {
+                cachedTail = tail.load(memory_order_acquire);
+                if (h == cachedTail) return NULL;
+            }
+            return &slots[h & mask];
+        }
+        // PRECONDITION: front() is not NULL
+        void pop() { head.store(head.load(memory_order_relaxed) + 1, memory_order_release); }
+
+        // any thread
+        // OUTPUT: true iff every element pushed so far has been popped
+        bool drained() const {
+            return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+        }
+
+    private:
+        vector<T> slots;
+        size_t mask;
+        alignas(64) atomic<size_t> head;  // next slot to pop, written by the consumer
+        size_t cachedTail;                // the consumer's copy of tail
+        alignas(64) atomic<size_t> tail;  // next slot to push, written by the producer
+        size_t cachedHead;                // the producer's copy of head
+};
+
+// A trade between the best buy and sell orders of a symbol, as recorded in the ledger
+struct Fill {
+    int seq;         // time stamp of the order (or modify) whose arrival caused the trade
+    int symbol;
+    Key buyKey;      // the traded orders' keys; the buy price is negated, as in the buy book
+    Key sellKey;
+    int numShares;
+    int idBuy;
+    int idSell;
+};
+
+// How long an order may rest: a limit order rests whatever is left of it after matching; an
+// immediate-or-cancel order drops its residual, and a fill-or-kill order trades in full right
+// away or not at all; neither ever enters the books
+enum OrderType { LIMIT_ORDER, IOC_ORDER, FOK_ORDER };
+
+// The types of the records of the event log
+enum EventType { EV_SYMBOL, EV_BUY, EV_SELL, EV_FILL, EV_CANCEL, EV_RESIZE, EV_AUCTION, EV_UNCROSS,
+                 EV_LOAD };
+
+// A record of the binary event log: what one order did to the books, in the order it happened.
+// Every record has the same size, so the log is written and read in large blocks; which fields are
+// used depends on the type (numbers are in the byte order of the machine that wrote the log)
+struct Event {
+    short type;
+    short orderType;  // buy, sell
+    int symbol;     // the symbol ID
+    int time;       // buy, sell, cancel, resize: the order's time stamp; fill: the buy order's
+    int other;      // buy, sell: the order ID (not the time stamp of a re-entered modified order);
+                    // fill: the sell order's time stamp; auction: 1 when it begins, 0 when it ends;
+                    // load: 1 before the orders loaded into the books of the symbol at once, 0 after
+    int numShares;  // buy, sell, resize: the shares the order has; fill, uncross: the shares traded;
+                    // symbol: the length of the name, whose characters fill the next records
+    int traderID;   // buy, sell
+    Ticks price;    // buy, sell; uncross: the clearing price of the fills that follow
+};
+static_assert(sizeof(Event) == 32, "event log records are 32 bytes");
+
+// Buffered writer of an event log file
+class EventLog {
+    public:
+        EventLog(size_t capacity = 1 << 15) : file(NULL), buf(capacity), len(0), written(0) { }
+        ~EventLog() { close(); }
+
+        bool open(const string& fname);
+        void append(const Event& ev) {
+            if (len == buf.size()) flush();
+            buf[len++] = ev;
+        }
+        void appendSymbol(int symbol, const string& name);
+        void flush();
+        void close();
+        long long bytes() const { return (written + (long long) len) * sizeof(Event); }
+
+    private:
+        FILE* file;
+        vector<Event> buf;
+        size_t len;
+        long long written;  // the number of records flushed to the file
+};
+
+// INPUT: the name of the file to write
+// OUTPUT: true iff the file could be created
+bool
+EventLog::open(const string& fname) {
+    file = fopen(fname.c_str(), "wb");
+    if (!file) cout << "Cannot open file " << fname << endl;
+    return (file != NULL);
+}
+
+// INPUT: a symbol ID and its name
+// POSTCONDITION: a symbol record is appended, followed by as many records as the name needs
+void
+EventLog::appendSymbol(int symbol, const string& name) {
+    Event ev = { EV_SYMBOL, LIMIT_ORDER, symbol, 0, 0, (int) name.size(), 0, 0 };
+    append(ev);
+    for (size_t i = 0; i < name.size(); i += sizeof(Event)) {
+        Event chars = Event();
+        memcpy(&chars, name.data() + i, min(sizeof(Event), name.size() - i));
+        append(chars);
+    }
+}
+
+// POSTCONDITION: the buffered records are written to the file
+void
+EventLog::flush() {
+    if (file && len > 0) fwrite(buf.data(), sizeof(Event), len, file);
+    written += len;
+    len = 0;
+}
+
+// POSTCONDITION: the buffered records are written and the file is closed
+void
+EventLog::close() {
+    flush();
+    if (file) fclose(file);
+    file = NULL;
+}
+
+// Buffered reader of an event log file
+class EventReader {
+    public:
+        EventReader(size_t capacity = 1 << 15) : file(NULL), buf(capacity), start(0), end(0) { }
+        ~EventReader() { if (file) fclose(file); }
+
+        bool open(const string& fname);
+        // OUTPUT: the next record of the log; NULL at the end of the log. The record stays valid
+        // until the next call
+        const Event* next() {
+            if (start == end) {
+                if (!file) return NULL;
+                end = fread(buf.data(), sizeof(Event), buf.size(), file);
+                start = 0;
+                if (end == 0) return NULL;
+            }
+            return &buf[start++];
+        }
+        bool nextSymbol(const Event& ev, string& name);
+
+    private:
+        FILE* file;
+        vector<Event> buf;
+        size_t start;  // next unread record in buf
+        size_t end;    // one past the last record read into buf
+};
+
+// INPUT: the name of the file to read
+// OUTPUT: true iff the file could be opened
+bool
+EventReader::open(const string& fname) {
+    file = fopen(fname.c_str(), "rb");
+    if (!file) cout << "Cannot open file " << fname << endl;
+    return (file != NULL);
+}
+
+// INPUT: a symbol record ev just read, and name (passed by ref)
+// OUTPUT: true iff the whole name could be read, in which case it is in name
+bool
+EventReader::nextSymbol(const Event& ev, string& name) {
+    int n = ev.numShares;
+    name.clear();
+    while ((int) name.size() < n) {
+        const Event* chars = next();
+        if (!chars) return false;
+        name.append((const char*) chars, min(sizeof(Event), (size_t) (n - name.size())));
+    }
+    return true;
+}
+
+// Aggregated depth of one side of a symbol's limit orders
+// The shares and the number of orders resting at each price are kept in a map by key price (buy
+// prices negated, as in the buy book) and updated as orders rest, trade and leave, so the best
+// levels are at the front of the map and the top N are printed in O(N), whatever the size of the
+// book.
+class Depth {
+    public:
+        // INPUT: the key price of an order entering the book and its number of shares
+        void add(Ticks price, int num) {
+            Level& level = levels[price];
+            level.shares += num;
+            level.orders++;
+        }
+        // INPUT: the key price of an order left in the book and the number of shares it lost
+        void reduce(Ticks price, int num) { level(price)->second.shares -= num; }
+        void remove(Ticks price, int num);
+        void load(const vector<Order>& orders);
+        void print(int n, bool buySide) const;
+        int size() const { return levels.size(); }
+
+    private:
+        struct Level {
+            long long shares;
+            int orders;
+            Level() : shares(0), orders(0) { }
+        };
+        typedef map<Ticks, Level> LevelMap;
+        LevelMap levels;
+
+        // INPUT: a key price with orders
+        // OUTPUT: its level; trades are at the best level, which is found without a search
+        LevelMap::iterator level(Ticks price) {
+            LevelMap::iterator it = levels.begin();
+            return (it->first == price) ? it : levels.find(price);
+        }
+};
+
+// INPUT: the key price of an order leaving the book and the number of shares it had left
+// POSTCONDITION: the order is taken out of its level, and a level left with no orders is dropped
+void
+Depth::remove(Ticks price, int num) {
+    LevelMap::iterator it = level(price);
+    it->second.shares -= num;
+    if (--it->second.orders == 0) levels.erase(it);
+}
+
+// INPUT: orders entering the book at once, with their key prices
+void
+Depth::load(const vector<Order>& orders) {
+    for (size_t k = 0; k < orders.size(); k++) add(orders[k].price(), orders[k].value.numShares);
+}
+
+// INPUT: a number of levels n, and whether the side is the buy side (whose key prices are negated)
+// POSTCONDITION: the n best levels are printed, best first, one line each with the price, the
+// shares and the number of orders; prices are fixed to two decimals from the first level on
+void
+Depth::print(int n, bool buySide) const {
+    if (n > 0 && !levels.empty()) output.setFixedPrices();
+    LevelMap::const_iterator it = levels.begin();
+    for (int k = 0; k < n && it != levels.end(); k++, ++it)
+        output << "$ " << Price((buySide) ? -it->first : it->first) << ": " << it->second.shares
+               << " shares in " << it->second.orders << ((it->second.orders == 1) ? " order" : " orders")
+               << '\n';
+}
+
+// Stock Market ADT
+class StockMarket {
+    private:
+        // the limit-order books of one symbol and their depth; the queues are created on the first
+        // order for the symbol, so an idle symbol costs two null pointers and two empty maps
+        struct Book {
+            PriorityQueue* buyOrders;
+            PriorityQueue* sellOrders;
+            Depth buyDepth;
+            Depth sellDepth;
+            Book() : buyOrders(NULL), sellOrders(NULL) { }
+        };
+        // where the order with a given order ID is: its current time stamp (-1 if none) and symbol
+        struct OrderRef {
+            int time;
+            int symbol;
+            OrderRef(int t, int s) : time(t), symbol(s) { }
+            bool operator==(const OrderRef& x) const { return time == x.time && symbol == x.symbol; }
+        };
+        // tells whether the order of an order ID has left its book (filled, or cancelled by time
+        // stamp, as a restored log does)
+        struct LeftBook {
+            const vector<Book>& books;
+            LeftBook(const vector<Book>& b) : books(b) { }
+            bool operator()(int, const OrderRef& r) const {
+                const Book& b = books[r.symbol];
+                return !b.buyOrders->find(r.time) && !b.sellOrders->find(r.time);
+            }
+        };
+
+        Engine engine;
+        SymbolTable ownSymbols;
+        SymbolTable* symbols;  // the market's own table, or one shared with other markets
+        vector<Book> books;  // indexed by symbol ID
+        Ledger ledger;
+        Ticks bank;
+        int counter = 0;
+        bool ledgerDiffs = false;  // print ledger prints only the changes since the last print
+        bool restFirst = false;  // legacy matching: orders enter their book before matching
+        bool auction = false;  // a call auction is collecting orders
+        // the crossing shares of one side at a price, for finding the clearing price of an auction
+        struct AuctionLevel {
+            Ticks price;
+            long long buy;
+            long long sell;
+            AuctionLevel(Ticks p, long long b, long long s) : price(p), buy(b), sell(s) { }
+            bool operator<(const AuctionLevel& x) const { return price < x.price; }
+        };
+        vector<AuctionLevel> auctionLevels;  // scratch space of uncross
+        vector<Order> crossing;              // scratch space of uncross
+        // by order ID, the orders that may still rest: an entry goes when its order is cancelled,
+        // and the entries of filled orders are swept when the index has doubled since the last sweep
+        TimeIndex<OrderRef> orderRefs;
+        int sweepRefs = 1 << 12;  // the number of entries of orderRefs at which it is next swept
+        long long numTrades = 0;
+        SpscRing<Fill>* fillLog = NULL;  // if set, fills go here instead of to the ledger
+        SpscRing<Fill>* ledgerQueue = NULL;  // the fill log of the market's own ledger thread
+        EventLog* eventLog = NULL;  // if set, every change to the books is appended here
+        thread ledgerWriter;
+        atomic<bool> stopping;
+#if MARKET_STATS
+        MarketStats stats;
+#endif
+
+        Book& openBook(int symbol);
+        const Book* findBook(int symbol) const;
+        void processTrade(Book& b, int symbol);
+        void trade(Book& b, int symbol);
+        bool tradeIncoming(Book& b, int symbol, Ticks price, int& num, int id, int t, bool buyTrans);
+        bool match(Book& b, int symbol, Ticks price, int& num, int id, int t, bool buyTrans);
+        int crossTops(Book& b, int symbol, Ticks price, int num);
+        void settle(const Fill& f);
+        void transAux(Book& b, int num, Ticks price, int id, int t, bool buyTrans);
+        bool removeOrder(Book& b, int t);
+        void buyAux(Book& b, int num, Ticks price, int id, int t);
+        void sellAux(Book& b, int num, Ticks price, int id, int t);
+        int placeOrder(int symbol, Ticks price, int num, int id, bool buyTrans, OrderType type);
+        void printHeader(const char* title, int symbol);
+        void writeLedger();
+        void logOrder(int symbol, Ticks price, int num, int id, int t, int orderId, bool buyTrans,
+                      OrderType type);
+        void logEvent(int type, int symbol, int t, int other, int num);
+
+    public:
+        StockMarket(Engine e = HEAP_ENGINE, SymbolTable* sharedSymbols = NULL)
+            : engine(e), symbols((sharedSymbols) ? sharedSymbols : &ownSymbols), books(1), bank(0),
+              orderRefs(OrderRef(-1, 0)), stopping(false) {
+            openBook(0);
+        };
+        ~StockMarket() {
+            if (ledgerQueue) {
+                stopping.store(true, memory_order_release);
+                ledgerWriter.join();
+                delete ledgerQueue;
+            }
+            for (size_t s = 0; s < books.size(); s++) {
+                delete books[s].buyOrders;
+                delete books[s].sellOrders;
+            }
+        };
+  
+        bool inAuction() const { return auction; }
+        int buy(Ticks price, int num, int id) { return placeOrder(0, price, num, id, true, LIMIT_ORDER); }
+        int sell(Ticks price, int num, int id) { return placeOrder(0, price, num, id, false, LIMIT_ORDER); }
+        int buy(int symbol, Ticks price, int num, int id, OrderType type = LIMIT_ORDER);
+        int sell(int symbol, Ticks price, int num, int id, OrderType type = LIMIT_ORDER);
+        bool cancel(int orderId);
+        bool modify(int orderId, int num, Ticks price);
+        void recordFill(const Fill& f);
+        int loadBook(const string& fname);
+        void loadOrders(int symbol, const vector<Order>& buys, const vector<Order>& sells);
+        void beginAuction();
+        void endAuction();
+        long long uncross(int symbol);
+        void logFills(SpscRing<Fill>* log) { fillLog = log; }
+        void logEvents(EventLog* log) { eventLog = log; }
+        bool restore(const string& fname);
+        void startLedgerThread();
+        void flushLedger();
+        void syncClock(int t);
+
+        void print();
+        void printBuy(int symbol = 0);
+        void printSell(int symbol = 0);
+        void printDepth(int levels, int symbol = 0);
+        void printLedger(int symbol = ALL_SYMBOLS);
+        void printSnapshot(int symbol = ALL_SYMBOLS);
+        void diffLedger(bool on) { ledgerDiffs = on; }
+        void matchAfterResting(bool on) { restFirst = on; }
+        void printBank();
+        void printPnl(bool all, int id = 0);
+        void printStorage();
+        void printStats();
+
+        SymbolTable& symbolTable() { return *symbols; }
+        bool hasBook(int symbol) const { return findBook(symbol) != NULL; }
+        int numOrders() const { return counter; }
+        int resting() const;
+        long long trades() const { return numTrades; }
+        Ticks getBank() {
+            flushLedger();
+            return bank;
+        }
+};
+
+// INPUT: a symbol ID
+// OUTPUT: the limit-order books of the symbol
+// POSTCONDITION: the books are created if this is the first order for the symbol
+StockMarket::Book&
+StockMarket::openBook(int symbol) {
+    if (symbol >= (int) books.size()) books.resize(symbol + 1);
+    Book& b = books[symbol];
+    if (!b.buyOrders) {
+        b.buyOrders = newPriorityQueue(engine);
+        b.sellOrders = newPriorityQueue(engine);
+        if (eventLog && symbol > 0) eventLog->appendSymbol(symbol, symbols->name(symbol));
+    }
+    return b;
+}
+
+// INPUT: a symbol ID
+// OUTPUT: the limit-order books of the symbol; NULL if there has been no order for it
+const StockMarket::Book*
+StockMarket::findBook(int symbol) const {
+    if (symbol < 0 || symbol >= (int) books.size() || !books[symbol].buyOrders) return NULL;
+    return &books[symbol];
+}
+
+// OUTPUT: the number of orders resting in the books of all of the symbols
+int
+StockMarket::resting() const {
+    int n = 0;
+    for (size_t s = 0; s < books.size(); s++)
+        if (books[s].buyOrders) n += books[s].buyOrders->size() + books[s].sellOrders->size();
+    return n;
+}
+
+// INPUT: the title of a section and the symbol it is about
+// POSTCONDITION: the section header is printed; the default symbol is not named
+void
+StockMarket::printHeader(const char* title, int symbol) {
+    output << "*** " << title;
+    if (symbol > 0) output << ": " << symbols->name(symbol);
+    output << " ***" << '\n';
+}
+
+void
+StockMarket::printBuy(int symbol) {
+    printHeader("Buy Limit Orders", symbol);
+    const Book* b = findBook(symbol);
+    if (b) b->buyOrders->print();
+}
+
+void
+StockMarket::printSell(int symbol) {
+    printHeader("Sell Limit Orders", symbol);
+    const Book* b = findBook(symbol);
+    if (b) b->sellOrders->print();
+}
+
+// INPUT: a number of levels and a symbol ID
+// POSTCONDITION: the best levels of the buy and sell orders of the symbol are printed, up to the
+// number of levels per side, in O(levels)
+void
+StockMarket::printDepth(int levels, int symbol) {
+    const Book* b = findBook(symbol);
+    printHeader("Buy Depth", symbol);
+    if (b) b->buyDepth.print(levels, true);
+    printHeader("Sell Depth", symbol);
+    if (b) b->sellDepth.print(levels, false);
+}
+
+void
+StockMarket::printLedger(int symbol) {
+    if (!ledgerDiffs) {
+        printSnapshot(symbol);
+        return;
+    }
+    flushLedger();
+    printHeader("Transaction Record Changes", symbol);
+    ledger.printChanges(*symbols, symbol);
+}
+
+void
+StockMarket::printSnapshot(int symbol) {
+    flushLedger();
+    printHeader("Transaction Record", symbol);
+    ledger.print(*symbols, symbol);
+}
+
+void
+StockMarket::printBank() {
+    flushLedger();
+    output << "*** Bank Profit ***" << '\n';
+    output << "$ " << Price(bank) << '\n';
+}
+
+// INPUT: whether to print every trader, and otherwise a trader ID
+// POSTCONDITION: the profit and loss of the trader (or of every trader) is printed, per symbol
+void
+StockMarket::printPnl(bool all, int id) {
+    flushLedger();
+    output << "*** Profit and Loss ***" << '\n';
+    ledger.printPnl(*symbols, all, id);
+}
+
+void
+StockMarket::printStorage() {
+    flushLedger();
+    output << "*** Ledger Storage ***" << '\n';
+    ledger.printStorage();
+}
+
+void
+StockMarket::printStats() {
+    output << "*** Market Statistics ***" << '\n';
+#if MARKET_STATS
+    stats.print();
+#else
+    output << "statistics compiled out (build with -DMARKET_STATS=1)" << '\n';
+#endif
+}
+
+// POSTCONDITION: the books of the default symbol and of every other symbol with orders are printed,
+// followed by the ledger of all of the symbols and the bank profit
+void
+StockMarket::print() {
+    for (int s = 0; s < (int) books.size(); s++) {
+        if (s > 0 && !findBook(s)) continue;
+        printBuy(s);
+        printSell(s);
+    }
+    printLedger();
+    printBank();
+}
+
+// INPUT: the books of a symbol, the number of shares and price involved in the trade, the trader's ID, and the time order was placed
+// POSTCONDITION: a new element for the order is added to the respective limit-order book of the symbol depending on the trade type
+void
+StockMarket::transAux(Book& b, int num, Ticks price, int id, int t, bool buyTrans) {
+    Order o(Key((buyTrans) ? -price : price, t), Value(num, id));
+    if (buyTrans) {
+        b.buyOrders->insert(o);
+        b.buyDepth.add(-price, num);
+    }
+    else {
+        b.sellOrders->insert(o);
+        b.sellDepth.add(price, num);
+    }
+}
+
+// INPUT: the books of a symbol and the time stamp of an order
+// OUTPUT: true iff the order was resting in one of the books
+// POSTCONDITION: the order is removed from its book and from the depth of its side
+bool
+StockMarket::removeOrder(Book& b, int t) {
+    Order* o = b.buyOrders->find(t);
+    if (o) {
+        b.buyDepth.remove(o->price(), o->value.numShares);
+        return b.buyOrders->remove(t);
+    }
+    o = b.sellOrders->find(t);
+    if (!o) return false;
+    b.sellDepth.remove(o->price(), o->value.numShares);
+    return b.sellOrders->remove(t);
+}
+
+// INPUT: the books of a symbol, the number of shares and price for the buy order placed by the trader with the given input id, and the time the buy order was placed
+// POSTCONDITION: a new element for the buy order is added to the respective buy limit-order book of the symbol
+void
+StockMarket::buyAux(Book& b, int num, Ticks price, int id, int t) {
+    transAux(b, num, price, id, t, true);
+}
+
+// INPUT: the books of a symbol, the number of shares and price for the sell order placed by the trader with the given input id, and the time the sell order was placed
+// POSTCONDITION: a new element for the sell order is added to the respective sell limit-order book of the symbol
+void
+StockMarket::sellAux(Book& b, int num, Ticks price, int id, int t) {
+    transAux(b, num, price, id, t, false);
+}
+
+// INPUT: a symbol ID, the price and number of shares for the buy order placed by the trader with the given input id, and its order type
+// POSTCONDITION: the buy order is matched against the sell limit-order book of the symbol, and a limit order rests whatever is left of it in the buy limit-order book
+int
+StockMarket::buy(int symbol, Ticks price, int num, int id, OrderType type) {
+    return placeOrder(symbol, price, num, id, true, type);
+}
+
+// INPUT: a symbol ID, the price and number of shares for the sell order placed by the trader with the given input id, and its order type
+// POSTCONDITION: the sell order is matched against the buy limit-order book of the symbol, and a limit order rests whatever is left of it in the sell limit-order book
+int
+StockMarket::sell(int symbol, Ticks price, int num, int id, OrderType type) {
+    return placeOrder(symbol, price, num, id, false, type);
+}
+
+// INPUT: a symbol ID, the price and number of shares of an order placed by the trader with the given input id, whether it is a buy order, and its order type
+// OUTPUT: the order ID, which is the time stamp the order was placed at; -1 for an immediate order
+// during a call auction, which is rejected without taking an order ID (a call auction only collects
+// limit orders, so it has nothing to trade with)
+// POSTCONDITION: the order walks the opposite book of the symbol, trading with each order it
+// crosses, and only a limit order with shares left enters its own book; a fill-or-kill order
+// trades only if the crossing orders have all of its shares. With MARKET_STATS, the latency of
+// each phase is recorded
+int
+StockMarket::placeOrder(int symbol, Ticks price, int num, int id, bool buyTrans, OrderType type) {
+    if (auction && type != LIMIT_ORDER) return -1;
+#if MARKET_STATS
+    long long start = statsClock();
+    stats.orderLedgerNs = 0;
+    stats.orderFills = 0;
+#endif
+    Book& b = openBook(symbol);
+    if (orderRefs.size() >= sweepRefs) {
+        orderRefs.eraseIf(LeftBook(books));
+        sweepRefs = max(1 << 12, 2 * orderRefs.size());
+    }
+    int t = counter++;
+    orderRefs.set(t, OrderRef(t, symbol));
+    // legacy matching rests every order, so outside an auction its orders act as limit orders
+    if (eventLog)
+        logOrder(symbol, price, num, id, t, t, buyTrans, (restFirst && !auction) ? LIMIT_ORDER : type);
+    if (auction) {
+        transAux(b, num, price, id, t, buyTrans);
+        return t;
+    }
+    if (restFirst) {
+        transAux(b, num, price, id, t, buyTrans);
+        trade(b, symbol);
+        return t;
+    }
+    bool left = true;
+    if (type != FOK_ORDER ||
+        ((buyTrans) ? b.sellOrders->available(price, num) : b.buyOrders->available(-price, num)) >= num)
+        left = match(b, symbol, price, num, id, t, buyTrans);
+#if MARKET_STATS
+    long long matched = statsClock();
+#endif
+    if (left && type == LIMIT_ORDER) {
+        transAux(b, num, price, id, t, buyTrans);
+#if MARKET_STATS
+        int size = (buyTrans) ? b.buyOrders->size() : b.sellOrders->size();
+        stats.heapDepth.record(64 - __builtin_clzll((unsigned long long) size | 1));
+#endif
+    }
+#if MARKET_STATS
+    long long end = statsClock();
+    stats.matchNs.record(matched - start - stats.orderLedgerNs);
+    stats.insertNs.record(end - matched);
+    stats.ledgerNs.record(stats.orderLedgerNs);
+    stats.totalNs.record(end - start);
+    stats.fills.record(stats.orderFills);
+#endif
+    return t;
+}
+
+// INPUT: the ID of an order
+// OUTPUT: true iff the order was resting in one of the limit-order books
+// POSTCONDITION: the order is removed from its book in O(log n)
+bool
+StockMarket::cancel(int orderId) {
+    OrderRef ref = orderRefs.get(orderId);
+    if (ref.time < 0) return false;
+    orderRefs.erase(orderId);
+    if (!removeOrder(books[ref.symbol], ref.time)) return false;
+    if (eventLog) logEvent(EV_CANCEL, ref.symbol, ref.time, 0, 0);
+    return true;
+}
+
+// INPUT: the ID of an order and its new number of shares and price
+// OUTPUT: true iff the order was resting in one of the limit-order books
+// POSTCONDITION: reducing the shares at the same price keeps the order in place with its time
+// priority; any other change removes the order and places it again at the back of the queue (with
+// a new time stamp but the same order ID), executing any trades that are now possible; a new
+// number of shares of 0 or less cancels the order
+bool
+StockMarket::modify(int orderId, int num, Ticks price) {
+    OrderRef ref = orderRefs.get(orderId);
+    if (ref.time < 0) return false;
+    int t = ref.time;
+    int symbol = ref.symbol;
+    Book& b = books[symbol];
+    bool buyTrans = (b.buyOrders->find(t) != NULL);
+    PriorityQueue* orders = (buyTrans) ? b.buyOrders : b.sellOrders;
+    Order* o = orders->find(t);
+    if (!o) {
+        orderRefs.erase(orderId);
+        return false;
+    }
+    Depth& depth = (buyTrans) ? b.buyDepth : b.sellDepth;
+    if (num <= 0) {
+        orderRefs.erase(orderId);
+        depth.remove(o->price(), o->value.numShares);
+        orders->remove(t);
+        if (eventLog) logEvent(EV_CANCEL, symbol, t, 0, 0);
+        return true;
+    }
+    if (o->price() == ((buyTrans) ? -price : price) && num <= o->value.numShares) {
+        depth.reduce(o->price(), o->value.numShares - num);
+        o->value.numShares = num;
+        if (eventLog) logEvent(EV_RESIZE, symbol, t, 0, num);
+        return true;
+    }
+    int id = o->value.traderID;
+    depth.remove(o->price(), o->value.numShares);
+    orders->remove(t);
+    if (eventLog) logEvent(EV_CANCEL, symbol, t, 0, 0);
+    t = counter++;
+    orderRefs.at(orderId).time = t;
+    if (eventLog) logOrder(symbol, price, num, id, t, orderId, buyTrans, LIMIT_ORDER);
+    if (auction) transAux(b, num, price, id, t, buyTrans);
+    else if (restFirst) {
+        transAux(b, num, price, id, t, buyTrans);
+        trade(b, symbol);
+    }
+    else if (match(b, symbol, price, num, id, t, buyTrans)) transAux(b, num, price, id, t, buyTrans);
+    return true;
+}
+
+// INPUT: the books of a symbol and its ID
+// PRECONDITION: there are matching orders in the limit-order books of the symbol
+// POSTCONDITION: any possible trade is executed, and properly documented/recorded (or passed to the fill log, if the market has one); the limit-order books of the symbol are properly updated and maintained; the stock market's bank balance is increased if there is a margin over the markets' spread (i.e., the buy limit-order price is higher than the sell limit-order price)
+void
+StockMarket::processTrade(Book& b, int symbol) {
+    Order* buyLimitOrder = b.buyOrders->min();
+    Order* sellLimitOrder = b.sellOrders->min();
+  
+    int numBuy = buyLimitOrder->value.numShares;
+    int numSell = sellLimitOrder->value.numShares;
+
+    int numTrade = (numBuy > numSell) ? numSell : numBuy;
+
+    Key buyKey = buyLimitOrder->key();
+    Key sellKey = sellLimitOrder->key();
+    int idBuy = buyLimitOrder->value.traderID;
+    int idSell = sellLimitOrder->value.traderID;
+
+    // a partially filled order keeps its key, so it stays in place at the top of its queue with
+    // its leftover shares; only fully filled orders are removed
+    if (numBuy > numTrade) {
+        buyLimitOrder->value.numShares -= numTrade;
+        b.buyDepth.reduce(buyKey.price, numTrade);
+    }
+    else {
+        b.buyOrders->removeMin();
+        b.buyDepth.remove(buyKey.price, numTrade);
+    }
+    if (numSell > numTrade) {
+        sellLimitOrder->value.numShares -= numTrade;
+        b.sellDepth.reduce(sellKey.price, numTrade);
+    }
+    else {
+        b.sellOrders->removeMin();
+        b.sellDepth.remove(sellKey.price, numTrade);
+    }
+
+    Fill f = { counter - 1, symbol, buyKey, sellKey, numTrade, idBuy, idSell };
+    settle(f);
+#if MARKET_STATS
+    if (numBuy != numSell) stats.partialFills++;
+#endif
+}
+
+// INPUT: the books of a symbol and its ID, the price and number of shares num (passed by ref) of
+// an incoming order placed by the trader with the given input id at time t, and whether it is a
+// buy order
+// OUTPUT: true iff the incoming order has shares left
+// PRECONDITION: the incoming order crosses the best order of the opposite book
+// POSTCONDITION: the incoming order trades with the best order of the opposite book, exactly as
+// processTrade would if the incoming order were the best order of its own book; num is decreased
+// by the shares traded
+bool
+StockMarket::tradeIncoming(Book& b, int symbol, Ticks price, int& num, int id, int t, bool buyTrans) {
+    PriorityQueue* opposite = (buyTrans) ? b.sellOrders : b.buyOrders;
+    Depth& depth = (buyTrans) ? b.sellDepth : b.buyDepth;
+    Order* resting = opposite->min();
+    int numResting = resting->value.numShares;
+    int numTrade = (num > numResting) ? numResting : num;
+    Key restingKey = resting->key();
+    int idResting = resting->value.traderID;
+    if (numResting > numTrade) {
+        resting->value.numShares -= numTrade;
+        depth.reduce(restingKey.price, numTrade);
+    }
+    else {
+        opposite->removeMin();
+        depth.remove(restingKey.price, numTrade);
+    }
+
+    Key incomingKey((buyTrans) ? -price : price, t);
+    Fill f = { t, symbol, (buyTrans) ? incomingKey : restingKey, (buyTrans) ? restingKey : incomingKey,
+               numTrade, (buyTrans) ? id : idResting, (buyTrans) ? idResting : id };
+    settle(f);
+#if MARKET_STATS
+    if (numResting != num) stats.partialFills++;
+#endif
+    if (num <= numTrade) return false;
+    num -= numTrade;
+    return true;
+}
+
+// INPUT: the books of a symbol and its ID, the price and number of shares num (passed by ref) of
+// an incoming order placed by the trader with the given input id at time t, and whether it is a
+// buy order
+// OUTPUT: true iff the incoming order has shares left, in which case num is what is left of it
+// POSTCONDITION: the incoming order walks the opposite book, trading with each order it crosses;
+// since the books do not cross before it arrives, the fills are the same as if it had entered its
+// own book first, without the insertion and removal
+bool
+StockMarket::match(Book& b, int symbol, Ticks price, int& num, int id, int t, bool buyTrans) {
+    PriorityQueue* opposite = (buyTrans) ? b.sellOrders : b.buyOrders;
+    Ticks limit = (buyTrans) ? price : -price;  // the worst key price the order crosses
+    while (!opposite->empty() && opposite->min()->price() <= limit)
+        if (!tradeIncoming(b, symbol, price, num, id, t, buyTrans)) return false;
+    return true;
+}
+
+// INPUT: a symbol ID, and its buy and sell orders, with their time stamps (which are their order
+// IDs) and the buy prices negated, as in the buy book
+// PRECONDITION: the time stamps are not in use
+// POSTCONDITION: the orders are added to the books of the symbol at once (PriorityQueue::load),
+// and orders that cross are then matched, best against best
+void
+StockMarket::loadOrders(int symbol, const vector<Order>& buys, const vector<Order>& sells) {
+    Book& b = openBook(symbol);
+    if (eventLog) logEvent(EV_LOAD, symbol, 0, 1, 0);
+    for (int side = 0; side < 2; side++) {
+        const vector<Order>& orders = (side == 0) ? buys : sells;
+        for (size_t k = 0; k < orders.size(); k++) {
+            int t = orders[k].timeStamp();
+            orderRefs.set(t, OrderRef(t, symbol));
+            if (t >= counter) counter = t + 1;
+            if (eventLog) {
+                Ticks price = (side == 0) ? -orders[k].price() : orders[k].price();
+                logOrder(symbol, price, orders[k].value.numShares, orders[k].value.traderID, t, t,
+                         side == 0, LIMIT_ORDER);
+            }
+        }
+    }
+    if (eventLog) logEvent(EV_LOAD, symbol, 0, 0, 0);
+    b.buyOrders->load(buys);
+    b.sellOrders->load(sells);
+    b.buyDepth.load(buys);
+    b.sellDepth.load(sells);
+    trade(b, symbol);
+}
+
+// POSTCONDITION: a call auction begins: orders rest in their books without matching (immediate
+// orders are rejected) until the auction ends
+void
+StockMarket::beginAuction() {
+    auction = true;
+    if (eventLog) logEvent(EV_AUCTION, 0, 0, 1, 0);
+}
+
+// POSTCONDITION: the call auction ends: the books of each symbol are uncrossed, in symbol order,
+// and continuous matching resumes
+void
+StockMarket::endAuction() {
+    if (!auction) return;
+    for (size_t s = 0; s < books.size(); s++) uncross(s);
+    auction = false;
+    if (eventLog) logEvent(EV_AUCTION, 0, 0, 0, 0);
+}
+
+// INPUT: a symbol ID
+// OUTPUT: the number of shares traded
+// POSTCONDITION: if the books of the symbol cross, they are uncrossed at a single clearing price:
+// the crossing orders are bucketed by price and one sweep up the prices finds the price at which
+// the most shares trade (with the fewest shares left unmatched on the heavier side, and in the
+// middle of any range of prices that remains); the buys at or above it and the sells at or below
+// it then trade at that price, in priority order, until the volume is reached
+long long
+StockMarket::uncross(int symbol) {
+    if (!hasBook(symbol)) return 0;
+    Book& b = books[symbol];
+    if (b.buyOrders->empty() || b.sellOrders->empty()) return 0;
+    Ticks bestBuy = -b.buyOrders->min()->price();
+    Ticks bestSell = b.sellOrders->min()->price();
+    if (bestBuy < bestSell) return 0;
+
+    // only the buys at or above the best sell and the sells at or below the best buy can trade
+    auctionLevels.clear();
+    long long demand = 0;  // the buys at or above the price of the sweep
+    crossing.clear();
+    b.buyOrders->collect(-bestSell, crossing);
+    for (size_t i = 0; i < crossing.size(); i++) {
+        auctionLevels.push_back(AuctionLevel(-crossing[i].price(), crossing[i].value.numShares, 0));
+        demand += crossing[i].value.numShares;
+    }
+    crossing.clear();
+    b.sellOrders->collect(bestBuy, crossing);
+    for (size_t i = 0; i < crossing.size(); i++)
+        auctionLevels.push_back(AuctionLevel(crossing[i].price(), 0, crossing[i].value.numShares));
+    sort(auctionLevels.begin(), auctionLevels.end());
+
+    long long supply = 0;  // the sells at or below the price of the sweep
+    long long volume = -1;
+    long long imbalance = 0;
+    Ticks low = 0;
+    Ticks high = 0;
+    for (size_t i = 0; i < auctionLevels.size(); ) {
+        Ticks p = auctionLevels[i].price;
+        long long buysHere = 0;
+        for (; i < auctionLevels.size() && auctionLevels[i].price == p; i++) {
+            supply += auctionLevels[i].sell;
+            buysHere += auctionLevels[i].buy;
+        }
+        long long v = min(demand, supply);
+        long long u = (demand > supply) ? demand - supply : supply - demand;
+        if (v > volume || (v == volume && u < imbalance)) {
+            volume = v;
+            imbalance = u;
+            low = high = p;
+        }
+        else if (v == volume && u == imbalance) high = p;
+        demand -= buysHere;
+    }
+    Ticks price = low + (high - low) / 2;
+
+    if (eventLog) {
+        Event ev = { EV_UNCROSS, LIMIT_ORDER, symbol, 0, 0, (int) min(volume, (long long) INT32_MAX), 0, price };
+        eventLog->append(ev);
+    }
+    for (long long left = volume; left > 0; )
+        left -= crossTops(b, symbol, price, (int) min(left, (long long) INT32_MAX));
+    return volume;
+}
+
+// INPUT: the books of a symbol and its ID, a price and a number of shares num
+// OUTPUT: the number of shares traded
+// PRECONDITION: neither book of the symbol is empty
+// POSTCONDITION: the best buy and sell orders of the symbol trade at the price, up to num shares;
+// an order left with no shares is removed from its book
+int
+StockMarket::crossTops(Book& b, int symbol, Ticks price, int num) {
+    Order* buyLimitOrder = b.buyOrders->min();
+    Order* sellLimitOrder = b.sellOrders->min();
+    int numBuy = buyLimitOrder->value.numShares;
+    int numSell = sellLimitOrder->value.numShares;
+    int numTrade = min(num, min(numBuy, numSell));
+    Fill f = { counter, symbol, Key(-price, buyLimitOrder->timeStamp()),
+               Key(price, sellLimitOrder->timeStamp()), numTrade, buyLimitOrder->value.traderID,
+               sellLimitOrder->value.traderID };
+    Ticks buyPrice = buyLimitOrder->price();
+    Ticks sellPrice = sellLimitOrder->price();
+    if (numBuy > numTrade) {
+        buyLimitOrder->value.numShares -= numTrade;
+        b.buyDepth.reduce(buyPrice, numTrade);
+    }
+    else {
+        b.buyOrders->removeMin();
+        b.buyDepth.remove(buyPrice, numTrade);
+    }
+    if (numSell > numTrade) {
+        sellLimitOrder->value.numShares -= numTrade;
+        b.sellDepth.reduce(sellPrice, numTrade);
+    }
+    else {
+        b.sellOrders->removeMin();
+        b.sellDepth.remove(sellPrice, numTrade);
+    }
+    settle(f);
+    return numTrade;
+}
+
+// INPUT: a fill
+// POSTCONDITION: the fill is appended to the event log (if the market has one), and recorded in
+// the ledger (or passed to the fill log, if the market has one)
+void
+StockMarket::settle(const Fill& f) {
+#if MARKET_STATS
+    long long ledgerStart = statsClock();
+#endif
+    if (eventLog) logEvent(EV_FILL, f.symbol, f.buyKey.timeStamp, f.sellKey.timeStamp, f.numShares);
+    if (fillLog) {
+        while (!fillLog->push(f)) this_thread::yield();
+    }
+    else recordFill(f);
+    numTrades++;
+#if MARKET_STATS
+    stats.orderLedgerNs += statsClock() - ledgerStart;
+    stats.orderFills++;
+    stats.numFills++;
+#endif
+}
+
+// INPUT: a fill
+// POSTCONDITION: the traded leg of each order is added to the ledger, and the stock market's bank
+// balance is increased by the margin over the spread
+void
+StockMarket::recordFill(const Fill& f) {
+    // for a fully filled order the traded leg is the whole order
+    ledger.buy(f.buyKey, Value(f.numShares, f.idBuy), f.symbol);
+    ledger.sell(f.sellKey, Value(f.numShares, f.idSell), f.symbol);
+    bank += (-f.buyKey.price - f.sellKey.price) * f.numShares;
+}
+
+// INPUT: a symbol ID, the price and number of shares of an order placed by the trader with the
+// given input id, its time stamp and order ID, whether it is a buy order, and its order type
+// POSTCONDITION: the order is appended to the event log
+void
+StockMarket::logOrder(int symbol, Ticks price, int num, int id, int t, int orderId, bool buyTrans,
+                      OrderType type) {
+    Event ev = { (short) ((buyTrans) ? EV_BUY : EV_SELL), (short) type, symbol, t, orderId, num, id, price };
+    eventLog->append(ev);
+}
+
+// INPUT: the type of an event, the symbol ID, the time stamp of the order it is about (the buy
+// order of a fill), the time stamp of the sell order of a fill, and the number of shares
+// POSTCONDITION: the event is appended to the event log
+void
+StockMarket::logEvent(int type, int symbol, int t, int other, int num) {
+    Event ev = { (short) type, LIMIT_ORDER, symbol, t, other, num, 0, 0 };
+    eventLog->append(ev);
+}
+
+// INPUT: the name of an event log file written by a market (see logEvents)
+// OUTPUT: true iff the file could be opened and all of its symbols and prices are in range (see
+// parsePrice); the restore stops at the first symbol or price out of range
+// PRECONDITION: no order has been placed in the market, and it has no ledger thread yet
+// POSTCONDITION: the market is in the state the logging market was in when the log ended, down to
+// the layout of its books: the changes to the books are applied in the order they were logged,
+// without parsing or looking for matches (each fill of an order is a trade with the best order of
+// the opposite book, and a limit order rests what is left of it once its fills are over); if the
+// market has an event log of its own, the records are copied to it
+bool
+StockMarket::restore(const string& fname) {
+    EventReader log;
+    if (!log.open(fname)) return false;
+    EventLog* copy = eventLog;
+    eventLog = NULL;
+    vector<int> symbolIds(1, 0);  // indexed by the symbol IDs of the log
+    string name;
+    Event order = Event();  // the order whose fills are being read; type EV_SYMBOL if none
+    bool left = false;      // whether the order has shares left
+    Event clearing = Event();  // the uncross whose fills are being read; type EV_SYMBOL if none
+    bool loading = false;      // the orders are for a load of the books
+    vector<Order> loadBuys;
+    vector<Order> loadSells;
+    const Event* ev;
+    while (true) {
+        ev = log.next();
+        if (order.type != EV_SYMBOL && !(ev && ev->type == EV_FILL)) {
+            if (left && order.orderType == LIMIT_ORDER)
+                transAux(books[order.symbol], order.numShares, order.price, order.traderID,
+                         order.time, order.type == EV_BUY);
+            order.type = EV_SYMBOL;
+        }
+        if (!(ev && ev->type == EV_FILL)) clearing.type = EV_SYMBOL;
+        if (!ev) break;
+        Event e = *ev;
+        const char* invalid = NULL;  // the field that is out of range, if any
+        if (e.type == EV_SYMBOL) {
+            if (e.symbol <= 0) invalid = "symbol";  // the default symbol is never declared
+        }
+        else if (e.symbol < 0 || e.symbol >= (int) symbolIds.size()) invalid = "symbol";
+        else if ((e.type == EV_BUY || e.type == EV_SELL || e.type == EV_UNCROSS) &&
+                 (e.price > MAX_PRICE_TICKS || e.price < -MAX_PRICE_TICKS))
+            invalid = "price";  // a log from a market with a different tick size, or a corrupt one
+        if (invalid) {
+            output << "Invalid " << invalid << " in event log " << fname << '\n';
+            eventLog = copy;
+            return false;
+        }
+        if (e.type == EV_SYMBOL) {
+            if (!log.nextSymbol(e, name)) break;  // a truncated log
+            if (e.symbol >= (int) symbolIds.size()) symbolIds.resize(e.symbol + 1, 0);
+            symbolIds[e.symbol] = symbols->intern(name.data(), name.data() + name.size());
+            if (copy) copy->appendSymbol(symbolIds[e.symbol], name);
+            continue;
+        }
+        e.symbol = symbolIds[e.symbol];
+        if (copy) copy->append(e);
+        Book& b = openBook(e.symbol);
+        switch (e.type) {
+            case EV_BUY:
+            case EV_SELL:
+                counter = e.time + 1;
+                orderRefs.set(e.other, OrderRef(e.time, e.symbol));  // a modify re-enters e.other
+                if (loading) {
+                    Order o(Key((e.type == EV_BUY) ? -e.price : e.price, e.time), Value(e.numShares, e.traderID));
+                    if (e.type == EV_BUY) loadBuys.push_back(o);
+                    else loadSells.push_back(o);
+                    break;
+                }
+                order = e;
+                left = true;
+                break;
+            case EV_FILL:
+                if (clearing.type != EV_SYMBOL) crossTops(b, e.symbol, clearing.price, e.numShares);
+                else if (order.type == EV_SYMBOL) processTrade(b, e.symbol);
+                else if (left) left = tradeIncoming(b, e.symbol, order.price, order.numShares,
+                                                    order.traderID, order.time, order.type == EV_BUY);
+                break;
+            case EV_CANCEL: removeOrder(b, e.time); break;
+            case EV_RESIZE: {
+                Order* o = b.buyOrders->find(e.time);
+                Depth& depth = (o) ? b.buyDepth : b.sellDepth;
+                if (!o) o = b.sellOrders->find(e.time);
+                if (!o) break;
+                depth.reduce(o->price(), o->value.numShares - e.numShares);
+                o->value.numShares = e.numShares;
+                break;
+            }
+            case EV_AUCTION: auction = (e.other != 0); break;
+            case EV_UNCROSS: clearing = e; break;
+            case EV_LOAD:
+                loading = (e.other != 0);
+                if (loading) break;
+                b.buyOrders->load(loadBuys);
+                b.sellOrders->load(loadSells);
+                b.buyDepth.load(loadBuys);
+                b.sellDepth.load(loadSells);
+                loadBuys.clear();
+                loadSells.clear();
+                break;
+        }
+    }
+    eventLog = copy;
+    return true;
+}
+
+// POSTCONDITION: the fills of the market are recorded by a ledger thread of its own, so matching
+// does not wait for the ledger; reading the ledger or the bank first waits for the thread to
+// catch up (flushLedger)
+void
+StockMarket::startLedgerThread() {
+    if (ledgerQueue || fillLog) return;
+    ledgerQueue = new SpscRing<Fill>(16);
+    fillLog = ledgerQueue;
+    ledgerWriter = thread(&StockMarket::writeLedger, this);
+}
+
+// POSTCONDITION: the fills in the ledger thread's queue are recorded as they arrive, until the
+// market is destroyed
+void
+StockMarket::writeLedger() {
+    while (true) {
+        Fill* f = ledgerQueue->front();
+        if (!f) {
+            if (stopping.load(memory_order_acquire)) return;
+            this_thread::yield();
+            continue;
+        }
+        recordFill(*f);
+        ledgerQueue->pop();
+    }
+}
+
+// POSTCONDITION: every fill so far is recorded in the ledger and the bank balance
+void
+StockMarket::flushLedger() {
+    if (!ledgerQueue) return;
+    while (!ledgerQueue->drained()) this_thread::yield();
+}
+
+// INPUT: a time stamp t no earlier than the market's clock
+// POSTCONDITION: the next order (or re-entered modified order) is placed at time t; used when the
+// time stamps are handed out by another market (the order IDs in between are not in this market)
+void
+StockMarket::syncClock(int t) {
+    counter = t;
+}
+
+// INPUT: the books of a symbol and its ID
+// POSTCONDITION: all possible trades of the symbol are processed/executed and recorded/documented, its limit-order books are properly updated/maintained, and the market profit from the respective trades (if any) is updated/increased
+void
+StockMarket::trade(Book& b, int symbol) {
+    if (b.buyOrders->empty() || b.sellOrders->empty()) return;
+    bool tradeAvail = true;
+    while (tradeAvail && !(b.buyOrders->empty() || b.sellOrders->empty())) {
+        Order* buyLimitOrder = b.buyOrders->min();
+        Order* sellLimitOrder = b.sellOrders->min();
+    
+        Ticks buyPrice = -buyLimitOrder->price();
+        Ticks sellPrice = sellLimitOrder->price();
+
+        Ticks marketSpread = sellPrice - buyPrice;
+
+        // process trades if lowest sell <= highest buy
+        tradeAvail = (marketSpread <= 0);
+        if (tradeAvail) processTrade(b, symbol);
+    }
+}
+
+// Reader of the lines of an input file
+// The file is read in large blocks into a reusable buffer and each line is handed out as a
+// pointer range into the buffer, so reading a line neither copies nor allocates.
+class LineReader {
+    public:
+        LineReader(size_t blockSize = 1 << 20) : file(NULL), buf(blockSize), start(0), end(0), eof(false) { }
+        ~LineReader() { if (file) fclose(file); }
+
+        bool open(const string& fname);
+        bool nextLine(const char*& b, const char*& e);
+
+    private:
+        FILE* file;
+        vector<char> buf;
+        size_t start;  // first unread character in buf
+        size_t end;    // one past the last character read into buf
+        bool eof;
+
+        void fill();
+};
+
+// INPUT: the name of the file to read
+// OUTPUT: true iff the file could be opened
+bool
+LineReader::open(const string& fname) {
+    file = fopen(fname.c_str(), "rb");
+    if (!file) output << "Cannot open file " << fname << '\n';
+    eof = (file == NULL);
+    return (file != NULL);
+}
+
+// POSTCONDITION: the unread characters are moved to the front of the buffer (which grows if they
+// fill it) and the rest of the buffer is filled from the file
+void
+LineReader::fill() {
+    if (start > 0) {
+        memmove(buf.data(), buf.data() + start, end - start);
+        end -= start;
+        start = 0;
+    }
+    if (end == buf.size()) buf.resize(2 * buf.size());
+    size_t got = fread(buf.data() + end, 1, buf.size() - end, file);
+    end += got;
+    if (got == 0) eof = true;
+}
+
+// INPUT: b and e (passed by ref)
+// OUTPUT: true iff there is another line, in which case [b, e) are its characters without the
+// end-of-line character; the range stays valid until the next call
+bool
+LineReader::nextLine(const char*& b, const char*& e) {
+    while (true) {
+        const char* p = buf.data() + start;
+        const char* nl = (const char*) memchr(p, '\n', end - start);
+        if (nl) {
+            b = p;
+            e = nl;
+            start = nl + 1 - buf.data();
+            return true;
+        }
+        if (eof) {
+            if (start == end) return false;
+            b = p;
+            e = buf.data() + end;
+            start = end;
+            return true;
+        }
+        fill();
+    }
+}
+
+// Types of the commands of the input stream
+enum CommandType { CMD_NONE, CMD_BUY, CMD_SELL, CMD_PRINT, CMD_PRINT_BUY, CMD_PRINT_SELL,
+                   CMD_PRINT_DEPTH, CMD_PRINT_LEDGER, CMD_PRINT_SNAPSHOT, CMD_PRINT_BANK, CMD_PRINT_PNL,
+                   CMD_PRINT_STORAGE, CMD_PRINT_STATS, CMD_CANCEL, CMD_MODIFY, CMD_AUCTION_BEGIN,
+                   CMD_AUCTION_END, CMD_LOAD_BOOK, CMD_INVALID };
+
+// Command structure for a parsed input line
+struct Command {
+    CommandType type;
+    int num;
+    Ticks price;
+    int id;
+    int orderId;
+    int symbol;
+    OrderType orderType;
+    bool allTraders;  // print pnl: for every trader rather than the one with the ID
+    string text;  // load book: the book file; an invalid line: the message it was rejected with
+    Command() : type(CMD_NONE), num(0), price(0), id(0), orderId(0), symbol(0), orderType(LIMIT_ORDER),
+        allTraders(false) { }
+};
+
+// INPUT: a position p in the characters [p, e) of a line, and tb and te (passed by ref)
+// OUTPUT: true iff there is another whitespace-separated token, in which case [tb, te) are its
+// characters and p is moved past it
+bool
+nextToken(const char*& p, const char* e, const char*& tb, const char*& te) {
+    while (p < e && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p == e) return false;
+    tb = p;
+    while (p < e && !(*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    te = p;
+    return true;
+}
+
+// INPUT: a token [b, e) and a word
+// OUTPUT: true iff the token is the word
+bool
+tokenIs(const char* b, const char* e, const char* word) {
+    size_t len = strlen(word);
+    return ((size_t) (e - b) == len) && (memcmp(b, word, len) == 0);
+}
+
+// INPUT: a token [b, e), and x (passed by ref)
+// OUTPUT: true iff the token is a decimal integer, with an optional sign, that fits in an int, in
+// which case x is its value
+bool
+parseInt(const char* b, const char* e, int& x) {
+    bool negative = (b < e && *b == '-');
+    if (negative || (b < e && *b == '+')) b++;
+    if (b == e) return false;
+    long long v = 0;
+    for (; b < e; b++) {
+        if (!isdigit((unsigned char) *b)) return false;
+        v = v * 10 + (*b - '0');
+        if (v > (long long) INT32_MAX + 1) return false;
+    }
+    if (negative) v = -v;
+    if (v > INT32_MAX) return false;
+    x = (int) v;
+    return true;
+}
+
+// INPUT: what a token of a line is (a field, or the whole line), and its characters [b, e)
+// OUTPUT: the command of a line rejected for the token
+Command
+invalidToken(const char* what, const char* b, const char* e) {
+    Command c;
+    c.type = CMD_INVALID;
+    c.text = "Invalid ";
+    c.text += what;
+    c.text += ' ';
+    c.text.append(b, e);
+    return c;
+}
+
+// INPUT: the characters [b, e) of an input line, and the table of symbols (passed by ref)
+// OUTPUT: the command on the line: "buy [<symbol>] <num> <price> <id> [ioc|fok]",
+// "sell [<symbol>] <num> <price> <id> [ioc|fok]", "cancel <orderId>", "modify <orderId> <num> <price>",
+// "auction begin|end", "load book <file>",
+// "print", "print buy|sell|ledger|snapshot [<symbol>]", "print depth <levels> [<symbol>]", "print
+// pnl [<id>]" or "print bank|storage|stats";
+// CMD_NONE for blank or unrecognized lines, and CMD_INVALID for lines with a number that is not a
+// decimal integer in the range of an int, an order for less than one share, a price that is not a valid decimal number or out of
+// range (see parsePrice), or an order whose fields do not match either form; orders without a
+// symbol are for the default symbol, as is "print buy|sell|depth" without one, while "print
+// ledger|snapshot" without one covers all of the symbols and "print pnl" without an ID all of the
+// traders; a symbol is not a number; orders are limit orders unless marked immediate-or-cancel
+// (ioc) or fill-or-kill (fok)
+// POSTCONDITION: a symbol seen for the first time is added to the table
+Command
+parseCommand(const char* b, const char* e, SymbolTable& symbols) {
+    Command c;
+    const char* line = b;
+    const char* tok[7];
+    const char* tokEnd[7];
+    int numTokens = 0;
+    while (numTokens < 7 && nextToken(b, e, tok[numTokens], tokEnd[numTokens])) numTokens++;
+    if (numTokens == 0) return c;
+    if (tokenIs(tok[0], tokEnd[0], "print")) {
+        if (numTokens == 1) c.type = CMD_PRINT;
+        else if (tokenIs(tok[1], tokEnd[1], "buy")) c.type = CMD_PRINT_BUY;
+        else if (tokenIs(tok[1], tokEnd[1], "sell")) c.type = CMD_PRINT_SELL;
+        else if (tokenIs(tok[1], tokEnd[1], "ledger")) c.type = CMD_PRINT_LEDGER;
+        else if (tokenIs(tok[1], tokEnd[1], "snapshot")) c.type = CMD_PRINT_SNAPSHOT;
+        else if (tokenIs(tok[1], tokEnd[1], "bank")) c.type = CMD_PRINT_BANK;
+        else if (tokenIs(tok[1], tokEnd[1], "storage"))
+            c.type = CMD_PRINT_STORAGE;
+        else if (tokenIs(tok[1], tokEnd[1], "stats")) c.type = CMD_PRINT_STATS;
+        else if (tokenIs(tok[1], tokEnd[1], "pnl")) {
+            c.type = CMD_PRINT_PNL;
+            c.allTraders = (numTokens == 2);
+            if (numTokens > 2 && !parseInt(tok[2], tokEnd[2], c.id))
+                return invalidToken("trader ID", tok[2], tokEnd[2]);
+            return c;
+        }
+        else if (tokenIs(tok[1], tokEnd[1], "depth")) {
+            if (numTokens < 3) return Command();
+            c.type = CMD_PRINT_DEPTH;
+            if (!parseInt(tok[2], tokEnd[2], c.num)) return invalidToken("depth", tok[2], tokEnd[2]);
+            if (numTokens > 3) c.symbol = symbols.intern(tok[3], tokEnd[3]);
+            return c;
+        }
+        if (numTokens > 2) c.symbol = symbols.intern(tok[2], tokEnd[2]);
+        else if (c.type == CMD_PRINT_LEDGER || c.type == CMD_PRINT_SNAPSHOT) c.symbol = ALL_SYMBOLS;
+        return c;
+    }
+    if (tokenIs(tok[0], tokEnd[0], "load")) {
+        if (numTokens < 3 || !tokenIs(tok[1], tokEnd[1], "book")) return c;
+        c.type = CMD_LOAD_BOOK;
+        c.text.assign(tok[2], tokEnd[2]);
+        return c;
+    }
+    if (tokenIs(tok[0], tokEnd[0], "auction")) {
+        if (numTokens < 2) return c;
+        if (tokenIs(tok[1], tokEnd[1], "begin")) c.type = CMD_AUCTION_BEGIN;
+        else if (tokenIs(tok[1], tokEnd[1], "end")) c.type = CMD_AUCTION_END;
+        return c;
+    }
+    if (tokenIs(tok[0], tokEnd[0], "cancel")) {
+        if (numTokens < 2) return c;
+        c.type = CMD_CANCEL;
+        if (!parseInt(tok[1], tokEnd[1], c.orderId)) return invalidToken("order ID", tok[1], tokEnd[1]);
+        return c;
+    }
+    if (numTokens < 4) return c;
+    if (tokenIs(tok[0], tokEnd[0], "modify")) {
+        c.type = CMD_MODIFY;
+        if (!parseInt(tok[1], tokEnd[1], c.orderId)) return invalidToken("order ID", tok[1], tokEnd[1]);
+        if (!parseInt(tok[2], tokEnd[2], c.num)) return invalidToken("number of shares", tok[2], tokEnd[2]);
+        if (!parsePrice(tok[3], tokEnd[3], c.price)) return invalidToken("price", tok[3], tokEnd[3]);
+        return c;
+    }
+    // buy/sell [symbol] # shares @ specific price, id [ioc|fok]
+    if (tokenIs(tok[0], tokEnd[0], "buy")) c.type = CMD_BUY;
+    else if (tokenIs(tok[0], tokEnd[0], "sell")) c.type = CMD_SELL;
+    else return c;
+    // the last token is the order type exactly when there is one token too many for the form
+    // without it: five tokens with a number where the symbol goes, or six
+    int last = numTokens - 1;
+    int x;
+    if (numTokens == 6 || (numTokens == 5 && parseInt(tok[1], tokEnd[1], x))) {
+        if (tokenIs(tok[last], tokEnd[last], "ioc")) c.orderType = IOC_ORDER;
+        else if (tokenIs(tok[last], tokEnd[last], "fok")) c.orderType = FOK_ORDER;
+        else return invalidToken("order type", tok[last], tokEnd[last]);
+        numTokens--;
+    }
+    else if (numTokens > 6) return invalidToken("order", line, e);
+    int i = 1;
+    if (numTokens == 5) {
+        c.symbol = symbols.intern(tok[1], tokEnd[1]);
+        i = 2;
+    }
+    if (!parseInt(tok[i], tokEnd[i], c.num) || c.num <= 0)
+        return invalidToken("number of shares", tok[i], tokEnd[i]);
+    if (!parsePrice(tok[i + 1], tokEnd[i + 1], c.price)) return invalidToken("price", tok[i + 1], tokEnd[i + 1]);
+    if (!parseInt(tok[i + 2], tokEnd[i + 2], c.id)) return invalidToken("trader ID", tok[i + 2], tokEnd[i + 2]);
+    return c;
+}
+
+// INPUT: the name of a book file, whose lines are orders as in the input ("buy|sell [<symbol>]
+// <num> <price> <id>"; other lines are skipped, and lines with an invalid price reported), a table of symbols and a clock (both passed by
+// ref), and the vectors buys and sells (passed by ref)
+// OUTPUT: the number of orders read; -1 if the file could not be opened
+// POSTCONDITION: the orders of each symbol are in buys and sells, indexed by symbol ID, with the
+// time stamps of the clock in file order (the clock is advanced past them) and the buy prices
+// negated, as in the buy book
+int
+readBook(const string& fname, SymbolTable& symbols, int& clock, vector<vector<Order> >& buys,
+         vector<vector<Order> >& sells) {
+    LineReader input;
+    if (!input.open(fname)) return -1;
+    const char* b;
+    const char* e;
+    int n = 0;
+    while (input.nextLine(b, e)) {
+        Command c = parseCommand(b, e, symbols);
+        if (c.type == CMD_INVALID) output << c.text << " in " << fname << '\n';
+        if (c.type != CMD_BUY && c.type != CMD_SELL) continue;
+        if (c.symbol >= (int) buys.size()) {
+            buys.resize(c.symbol + 1);
+            sells.resize(c.symbol + 1);
+        }
+        bool buyTrans = (c.type == CMD_BUY);
+        Order o(Key((buyTrans) ? -c.price : c.price, clock++), Value(c.num, c.id));
+        if (buyTrans) buys[c.symbol].push_back(o);
+        else sells[c.symbol].push_back(o);
+        n++;
+    }
+    return n;
+}
+
+// INPUT: the name of a book file
+// OUTPUT: the number of orders loaded; -1 if the file could not be opened
+// POSTCONDITION: the orders of the file are placed in the books of their symbols, in file order
+// (see readBook), each book being built at once; orders that cross are then matched
+int
+StockMarket::loadBook(const string& fname) {
+    vector<vector<Order> > buys;
+    vector<vector<Order> > sells;
+    int n = readBook(fname, *symbols, counter, buys, sells);
+    for (size_t s = 0; s < buys.size(); s++)
+        if (!buys[s].empty() || !sells[s].empty()) loadOrders(s, buys[s], sells[s]);
+    return n;
+}
+
+// INPUT: an immediate order command
+// POSTCONDITION: the rejection of the order by a call auction is printed
+void
+printAuctionReject(const Command& c) {
+    output << "Rejected " << ((c.orderType == IOC_ORDER) ? "ioc" : "fok")
+           << " order: a call auction only collects limit orders" << '\n';
+}
+
+// INPUT: a stock market M and a command c
+// POSTCONDITION: c is executed on M
+void
+runCommand(StockMarket& M, const Command& c) {
+    switch (c.type) {
+        case CMD_BUY:
+            if (M.buy(c.symbol, c.price, c.num, c.id, c.orderType) < 0) printAuctionReject(c);
+            break;
+        case CMD_SELL:
+            if (M.sell(c.symbol, c.price, c.num, c.id, c.orderType) < 0) printAuctionReject(c);
+            break;
+        case CMD_PRINT: M.print(); break;
+        case CMD_PRINT_BUY: M.printBuy(c.symbol); break;
+        case CMD_PRINT_SELL: M.printSell(c.symbol); break;
+        case CMD_PRINT_DEPTH: M.printDepth(c.num, c.symbol); break;
+        case CMD_PRINT_LEDGER: M.printLedger(c.symbol); break;
+        case CMD_PRINT_SNAPSHOT: M.printSnapshot(c.symbol); break;
+        case CMD_PRINT_BANK: M.printBank(); break;
+        case CMD_PRINT_PNL: M.printPnl(c.allTraders, c.id); break;
+        case CMD_PRINT_STORAGE: M.printStorage(); break;
+        case CMD_PRINT_STATS: M.printStats(); break;
+        case CMD_CANCEL: M.cancel(c.orderId); break;
+        case CMD_MODIFY: M.modify(c.orderId, c.num, c.price); break;
+        case CMD_AUCTION_BEGIN: M.beginAuction(); break;
+        case CMD_AUCTION_END: M.endAuction(); break;
+        case CMD_LOAD_BOOK: M.loadBook(c.text); break;
+        case CMD_INVALID: output << c.text << '\n'; break;
+        case CMD_NONE: break;
+    }
+}
+
+// Stock market whose symbols are matched in parallel by worker threads
+// The symbols are split over the shards by ID; each shard is a worker thread with its own market
+// holding the books of its symbols. The calling (routing) thread hands out the order IDs and sends
+// each order through a lock-free ring to the shard owning its symbol. Shards do not touch the
+// ledger: their fills go through a second ring to a merger thread, which applies them to a single
+// ledger in seq order (the time stamp of the order that caused each fill), i.e., in the order the
+// single-threaded market records them. Every record then holds the same transactions in the same
+// order, and the ledger prints its records in trader-ID order whatever order they were created
+// in, so the printed output is the same.
+// Commands that read or change state across shards (prints, modify, auctions and book loads) wait
+// for all the shards and the merger to catch up first.
+class ShardedMarket {
+    public:
+        ShardedMarket(int numShards, Engine engine = HEAP_ENGINE);
+        ~ShardedMarket();
+
+        void run(const Command& c);
+        void sync();
+        void print();
+
+        SymbolTable& symbolTable() { return symbols; }
+        void diffLedger(bool on) { report.diffLedger(on); }
+        int numOrders() const { return counter; }
+        int resting();
+        long long trades();
+        Ticks getBank();
+
+    private:
+        struct Shard {
+            StockMarket market;
+            SpscRing<Command> commands;
+            SpscRing<Fill> fills;
+            atomic<long long> processed;  // number of commands executed
+            atomic<int> watermark;  // all fills of the shard's orders up to this time are logged
+            long long submitted;  // number of commands sent; used by the routing thread only
+            thread worker;
+            Shard(Engine engine, SymbolTable* symbols)
+                : market(engine, symbols), processed(0), watermark(-1), submitted(0) {
+                market.logFills(&fills);
+            }
+        };
+
+        SymbolTable symbols;
+        StockMarket report;  // the ledger and bank of all of the shards
+        vector<Shard*> shards;
+        vector<Fill*> heads;  // scratch space of the merger
+        vector<int> marks;
+        thread merger;
+        atomic<bool> stopping;
+        atomic<int> routed;  // every order before this time stamp has been sent to its shard
+        int counter;
+        bool auction;  // a call auction is collecting orders
+        vector<int> orderSymbol;  // symbol of the order with each order ID; -1 if none
+
+        Shard& owner(int symbol) { return *shards[symbol % shards.size()]; }
+        void submit(Shard& s, const Command& c);
+        void work(Shard* s);
+        void merge();
+        bool mergeNext();
+};
+
+// INPUT: the number of shards (worker threads) and the engine of their books
+ShardedMarket::ShardedMarket(int numShards, Engine engine)
+    : report(engine, &symbols), heads(numShards), marks(numShards), stopping(false), routed(0),
+      counter(0), auction(false) {
+    for (int i = 0; i < numShards; i++) shards.push_back(new Shard(engine, &symbols));
+    for (int i = 0; i < numShards; i++) shards[i]->worker = thread(&ShardedMarket::work, this, shards[i]);
+    merger = thread(&ShardedMarket::merge, this);
+}
+
+ShardedMarket::~ShardedMarket() {
+    sync();
+    stopping.store(true, memory_order_release);
+    merger.join();
+    for (size_t i = 0; i < shards.size(); i++) {
+        shards[i]->worker.join();
+        delete shards[i];
+    }
+}
+
+// INPUT: a shard and a command for it
+// POSTCONDITION: the command is queued for the shard's worker
+void
+ShardedMarket::submit(Shard& s, const Command& c) {
+    while (!s.commands.push(c)) this_thread::yield();
+    s.submitted++;
+}
+
+// INPUT: a shard
+// POSTCONDITION: the shard's commands are executed as they arrive, until the market stops
+void
+ShardedMarket::work(Shard* s) {
+    while (true) {
+        Command* c = s->commands.front();
+        if (!c) {
+            if (stopping.load(memory_order_acquire)) return;
+            this_thread::yield();
+            continue;
+        }
+        if (c->type == CMD_CANCEL) s->market.cancel(c->orderId);
+        else {
+            s->market.syncClock(c->orderId);
+            if (c->type == CMD_BUY) s->market.buy(c->symbol, c->price, c->num, c->id, c->orderType);
+            else s->market.sell(c->symbol, c->price, c->num, c->id, c->orderType);
+            s->watermark.store(c->orderId, memory_order_release);
+        }
+        s->commands.pop();
+        s->processed.store(s->processed.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+}
+
+// POSTCONDITION: the fills of the shards are recorded as they arrive, until the market stops
+void
+ShardedMarket::merge() {
+    while (!stopping.load(memory_order_acquire))
+        if (!mergeNext()) this_thread::yield();
+}
+
+// OUTPUT: true iff a fill was recorded
+// POSTCONDITION: the fill with the earliest time stamp is recorded in the ledger, provided that no
+// shard can still log an earlier one
+bool
+ShardedMarket::mergeNext() {
+    // the watermarks are read before the rings: a fill up to a shard's watermark was pushed before
+    // the watermark was published, so a shard whose ring is empty has no fill up to its watermark;
+    // a shard that has executed all of its commands has matched every order sent before routed
+    int r = routed.load(memory_order_acquire);
+    for (size_t i = 0; i < shards.size(); i++) {
+        marks[i] = shards[i]->watermark.load(memory_order_acquire);
+        if (shards[i]->commands.drained() && marks[i] < r - 1) marks[i] = r - 1;
+    }
+    int best = -1;
+    for (size_t i = 0; i < shards.size(); i++) {
+        heads[i] = shards[i]->fills.front();
+        if (heads[i] && (best < 0 || heads[i]->seq < heads[best]->seq)) best = (int) i;
+    }
+    if (best < 0) return false;
+    for (size_t i = 0; i < shards.size(); i++)
+        if (!heads[i] && marks[i] < heads[best]->seq) return false;
+    report.recordFill(*heads[best]);
+    shards[best]->fills.pop();
+    return true;
+}
+
+// POSTCONDITION: every command sent so far is executed and all of its fills are recorded; the
+// shards and the ledger can be read (or changed) by the routing thread until the next command
 void
-StockMarket::printLedger() {
-    cout << "*** Transaction Record ***" << endl;
-    books.print();
+ShardedMarket::sync() {
+    for (size_t i = 0; i < shards.size(); i++)
+        while (shards[i]->processed.load(memory_order_acquire) != shards[i]->submitted)
+            this_thread::yield();
+    for (size_t i = 0; i < shards.size(); i++)
+        while (!shards[i]->fills.drained()) this_thread::yield();
 }
 
+// INPUT: a command
+// POSTCONDITION: the command is executed as by runCommand on a single market; orders and cancels
+// are only queued for their shard
 void
-StockMarket::printBank() {
-    cout << "*** Bank Profit ***" << endl;
-    cout << "$ " << bank << endl;
+ShardedMarket::run(const Command& c) {
+    bool known = (c.orderId >= 0 && c.orderId < (int) orderSymbol.size() && orderSymbol[c.orderId] >= 0);
+    switch (c.type) {
+        case CMD_BUY:
+        case CMD_SELL: {
+            if (auction && c.orderType != LIMIT_ORDER) {
+                printAuctionReject(c);
+                break;
+            }
+            Command order = c;
+            order.orderId = counter++;
+            orderSymbol.push_back(c.symbol);
+            submit(owner(c.symbol), order);
+            routed.store(counter, memory_order_release);
+            break;
+        }
+        case CMD_CANCEL:
+            if (known) submit(owner(orderSymbol[c.orderId]), c);
+            break;
+        case CMD_MODIFY:
+            if (!known) break;
+            sync();
+            // the modify's fills (at time counter) are logged by this thread, so the shards are
+            // told that no order of theirs can trade at that time; if the modify does not take the
+            // time stamp, the next order does, and no other order can then trade at that time
+            routed.store(counter + 1, memory_order_release);
+            {
+                StockMarket& M = owner(orderSymbol[c.orderId]).market;
+                M.syncClock(counter);
+                M.modify(c.orderId, c.num, c.price);
+                counter = M.numOrders();
+                orderSymbol.resize(counter, -1);
+            }
+            sync();
+            break;
+        case CMD_AUCTION_BEGIN:
+            sync();
+            for (size_t i = 0; i < shards.size(); i++) shards[i]->market.beginAuction();
+            auction = true;
+            break;
+        case CMD_AUCTION_END:
+            sync();
+            // the symbols are uncrossed in order by this thread, each at time counter (as for
+            // modify), and the fills of each are merged before the next one is uncrossed
+            routed.store(counter + 1, memory_order_release);
+            for (int s = 0; s < symbols.size(); s++) {
+                StockMarket& M = owner(s).market;
+                M.syncClock(counter);
+                if (M.uncross(s) > 0) sync();
+            }
+            for (size_t i = 0; i < shards.size(); i++) shards[i]->market.endAuction();
+            auction = false;
+            break;
+        case CMD_LOAD_BOOK: {
+            sync();
+            vector<vector<Order> > buys;
+            vector<vector<Order> > sells;
+            if (readBook(c.text, symbols, counter, buys, sells) < 0) break;
+            orderSymbol.resize(counter, -1);
+            // crossing orders trade as each symbol is loaded, at the time stamps of the book, so
+            // the symbols are loaded in order and the fills of each are merged before the next
+            routed.store(counter + 1, memory_order_release);
+            for (size_t s = 0; s < buys.size(); s++) {
+                for (size_t k = 0; k < buys[s].size(); k++) orderSymbol[buys[s][k].timeStamp()] = s;
+                for (size_t k = 0; k < sells[s].size(); k++) orderSymbol[sells[s][k].timeStamp()] = s;
+                if (buys[s].empty() && sells[s].empty()) continue;
+                StockMarket& M = owner(s).market;
+                M.syncClock(counter);
+                M.loadOrders(s, buys[s], sells[s]);
+                sync();
+            }
+            break;
+        }
+        case CMD_PRINT: sync(); print(); break;
+        case CMD_PRINT_BUY: sync(); owner(c.symbol).market.printBuy(c.symbol); break;
+        case CMD_PRINT_SELL: sync(); owner(c.symbol).market.printSell(c.symbol); break;
+        case CMD_PRINT_DEPTH: sync(); owner(c.symbol).market.printDepth(c.num, c.symbol); break;
+        case CMD_PRINT_LEDGER: sync(); report.printLedger(c.symbol); break;
+        case CMD_PRINT_SNAPSHOT: sync(); report.printSnapshot(c.symbol); break;
+        case CMD_PRINT_BANK: sync(); report.printBank(); break;
+        case CMD_PRINT_PNL: sync(); report.printPnl(c.allTraders, c.id); break;
+        case CMD_PRINT_STORAGE: sync(); report.printStorage(); break;
+        case CMD_PRINT_STATS:
+            sync();
+            for (size_t i = 0; i < shards.size(); i++) shards[i]->market.printStats();
+            break;
+        case CMD_INVALID: output << c.text << '\n'; break;
+        case CMD_NONE: break;
+    }
 }
 
+// PRECONDITION: the market is in sync
+// POSTCONDITION: the market is printed as StockMarket::print prints it
 void
-StockMarket::print() {
-    printBuy();
-    printSell();
-    printLedger();
-    printBank();
+ShardedMarket::print() {
+    for (int s = 0; s < symbols.size(); s++) {
+        StockMarket& M = owner(s).market;
+        if (s > 0 && !M.hasBook(s)) continue;
+        M.printBuy(s);
+        M.printSell(s);
+    }
+    report.printLedger();
+    report.printBank();
+}
+
+// OUTPUT: the number of orders resting in the books of all of the shards
+int
+ShardedMarket::resting() {
+    sync();
+    int n = 0;
+    for (size_t i = 0; i < shards.size(); i++) n += shards[i]->market.resting();
+    return n;
+}
+
+// OUTPUT: the number of trades of all of the shards
+long long
+ShardedMarket::trades() {
+    sync();
+    long long n = 0;
+    for (size_t i = 0; i < shards.size(); i++) n += shards[i]->market.trades();
+    return n;
+}
+
+// OUTPUT: the bank profit of all of the shards
+Ticks
+ShardedMarket::getBank() {
+    sync();
+    return report.getBank();
 }
 
-// INPUT: the number of shares and price involved in the trade, the trader's ID, and the time order was placed
-// POSTCONDITION: a new element for the order is added to the respective limit-order book for the stock market depending on the trade type
+// INPUT: a sharded stock market M and a command c
+// POSTCONDITION: c is executed on M
 void
-StockMarket::transAux(int num, double price, int id, int t, bool buyTrans) {
-    Key* k = new Key(price * ((buyTrans) ? -1.0 : 1.0), t);
-    Value* v = new Value(num, id);
-    Elem* e = new Elem(k, v);
-    if (buyTrans) buyOrders.insert(e);
-    else sellOrders.insert(e);
+runCommand(ShardedMarket& M, const Command& c) {
+    M.run(c);
+}
+
+// Replay of an input file
+
+typedef chrono::steady_clock Clock;
+
+// INPUT: a starting time point
+// OUTPUT: the number of seconds elapsed since start
+double
+secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
 }
 
-// INPUT: the number of shares and price for the buy order placed by the trader with the given input id, and the time the buy order was placed
-// POSTCONDITION: a new element for the buy order is added to the respective buy limit-order book for the stock market
+// INPUT: a stock market M (single-threaded or sharded) and the time the replay started
+// POSTCONDITION: the summary of a quiet run is printed
+template <typename Market>
 void
-StockMarket::buyAux(int num, double price, int id, int t) {
-    transAux(num, price, id, t, true);
+printSummary(Market& M, Clock::time_point start) {
+    long long trades = M.trades();
+    double seconds = secondsSince(start);
+    char rate[64];
+    snprintf(rate, sizeof(rate), "%.6f s, %.0f orders/s", seconds, M.numOrders() / seconds);
+    output.setFixedPrices();
+    output << "orders: " << M.numOrders() << '\n';
+    output << "trades: " << trades << '\n';
+    output << "bank: $ " << Price(M.getBank()) << '\n';
+    output << "time: " << rate << '\n';
 }
 
-// INPUT: the number of shares and price for the sell order placed by the trader with the given input id, and the time the sell order was placed
-// POSTCONDITION: a new element for the sell order is added to the respective sell limit-order book for the stock market
+// INPUT: a stock market M (single-threaded or sharded), an open input file and whether to run quietly
+// POSTCONDITION: the commands of the file are executed on M, echoing each line, or, in a quiet run,
+// only its buy and sell commands are executed and a summary is printed
+template <typename Market>
 void
-StockMarket::sellAux(int num, double price, int id, int t) {
-    transAux(num, price, id, t, false);
+replay(Market& M, LineReader& input, bool quiet) {
+    const char* b;
+    const char* e;
+    Clock::time_point start = Clock::now();
+    while (input.nextLine(b, e))
+    {
+        if (quiet) {
+            Command c = parseCommand(b, e, M.symbolTable());
+            if (c.type == CMD_BUY || c.type == CMD_SELL) runCommand(M, c);
+            continue;
+        }
+        // echo input
+        output.write(b, e - b);
+        output.put('\n');
+        runCommand(M, parseCommand(b, e, M.symbolTable()));
+    }
+    if (quiet) printSummary(M, start);
+}
+
+// A batch of input lines handed from stage to stage of the replay pipeline
+struct LineBatch {
+    static const int MAX_LINES = 1024;
+    vector<Command> commands;  // the command on each line
+    string echo;               // the lines, each ending with a newline; empty in a quiet run
+    vector<size_t> echoEnds;   // end of each line in echo
+    vector<string> symbols;    // the symbols seen for the first time in the batch, in order
+    string printed;            // what the batch's print commands printed, filled in by the matcher
+    vector<size_t> printEnds;  // end of the output of each line's command in printed
+    bool last;                 // the batch ends the input
+    void clear() {
+        commands.clear();
+        echo.clear();
+        echoEnds.clear();
+        symbols.clear();
+        printed.clear();
+        printEnds.clear();
+        last = false;
+    }
+};
+
+// Three-stage replay pipeline: a parser thread, the matching (calling) thread and a writer thread
+// The stages hand each other batches of lines through lock-free rings, and the writer hands the
+// written batches back to the parser for reuse. The matcher only executes the commands: the echo
+// is copied by the parser, print commands print into the batch (through the output buffer, so its
+// price format carries over from print to print), and the writer interleaves the two.
+class ReplayPipeline {
+    public:
+        ReplayPipeline(LineReader& in, FILE* out, bool q)
+            : input(in), file(out), quiet(q), parsed(4), matched(4), recycled(5), batches(16) {
+            for (size_t i = 0; i < batches.size(); i++) {
+                batches[i].clear();
+                recycled.push(&batches[i]);
+            }
+        }
+
+        template <typename Market> void run(Market& M);
+
+    private:
+        LineReader& input;
+        FILE* file;
+        bool quiet;
+        SpscRing<LineBatch*> parsed;   // parser to matcher
+        SpscRing<LineBatch*> matched;  // matcher to writer
+        SpscRing<LineBatch*> recycled; // writer to parser
+        vector<LineBatch> batches;
+
+        static LineBatch* take(SpscRing<LineBatch*>& ring);
+        static void give(SpscRing<LineBatch*>& ring, LineBatch* batch);
+        void parse();
+        void write();
+};
+
+// INPUT: a ring of batches
+// OUTPUT: the next batch of the ring, waiting for one if the ring is empty
+LineBatch*
+ReplayPipeline::take(SpscRing<LineBatch*>& ring) {
+    LineBatch** b;
+    while (!(b = ring.front())) this_thread::yield();
+    LineBatch* batch = *b;
+    ring.pop();
+    return batch;
 }
 
-// INPUT: the price and number of shares for the buy order placed by the trader with the given input id
-// POSTCONDITION: a new element for the buy order is added to the respective buy limit-order book for the stock market and a trade is executed if there is a matching sell order already in the limit-order books for the stock market
+// INPUT: a ring of batches and a batch
+// POSTCONDITION: the batch is added to the ring
 void
-StockMarket::buy(double price, int num, int id) {
-    buyAux(num, price, id, counter++);
-    trade();
+ReplayPipeline::give(SpscRing<LineBatch*>& ring, LineBatch* batch) {
+    while (!ring.push(batch)) this_thread::yield();
 }
 
-// INPUT: the price and number of shares for the sell order placed by the trader with the given input id
-// POSTCONDITION: a new element for the sell order is added to the respective sell limit-order book for the stock market and a trade is executed if there is a matching buy order already in the limit-order books for the stock market
+// POSTCONDITION: the lines of the input are parsed into batches for the matcher; symbols are
+// interned in a table of the parser's own, and the matcher interns them again in the same order
+// (a book file loaded by the matcher can add symbols of its own, so the IDs are translated)
 void
-StockMarket::sell(double price, int num, int id) {
-    sellAux(num, price, id, counter++);
-    trade();
+ReplayPipeline::parse() {
+    SymbolTable symbols;
+    LineBatch* batch = take(recycled);
+    const char* b;
+    const char* e;
+    while (input.nextLine(b, e)) {
+        int known = symbols.size();
+        Command c = parseCommand(b, e, symbols);
+        if (symbols.size() > known) batch->symbols.push_back(symbols.name(known));
+        if (quiet && c.type != CMD_BUY && c.type != CMD_SELL) continue;
+        batch->commands.push_back(c);
+        if (!quiet) {
+            batch->echo.append(b, e - b);
+            batch->echo.push_back('\n');
+            batch->echoEnds.push_back(batch->echo.size());
+        }
+        if ((int) batch->commands.size() == LineBatch::MAX_LINES) {
+            give(parsed, batch);
+            batch = take(recycled);
+        }
+    }
+    batch->last = true;
+    give(parsed, batch);
 }
 
-// PRECONDITION: there are matching orders in the limit-order books for the stock market
-// POSTCONDITION: any possible trade is executed, and properly documented/recorded; the limit-order books for the stock market are properly updated and maintained; the stock market's bank balance is increased if there is a margin over the markets' spread (i.e., the buy limit-order price is higher than the sell limit-order price)
+// POSTCONDITION: the echo and printed output of the batches from the matcher are written out in
+// order, and the batches are handed back to the parser
 void
-StockMarket::processTrade() {
-    Elem* buyMin = buyOrders.min();
-    Elem* sellMin = sellOrders.min();
-    Elem* buyLimitOrder = new Elem(buyMin);
-    Elem* sellLimitOrder = new Elem(sellMin);
-  
-    double priceBuy = -buyLimitOrder->key->price;
-    double priceSell = sellLimitOrder->key->price;
-    int timeBuy = buyLimitOrder->key->timeStamp;
-    int timeSell = sellLimitOrder->key->timeStamp;
-    int numBuy = buyLimitOrder->value->numShares;
-    int numSell = sellLimitOrder->value->numShares;
-    int idBuy = buyLimitOrder->value->traderID;
-    int idSell = sellLimitOrder->value->traderID;
-
-    double priceDiff = priceBuy - priceSell;
-
-    int numTrade;
-    int numRemain;
-
-    Elem* buyTrade;
-    Elem* sellTrade;
-    Key* k;
-    Value* v;
-
-    sellOrders.removeMin();
-    buyOrders.removeMin();
-
-    if (numBuy > numSell) {
-        numTrade = numSell;
-        sellTrade = sellLimitOrder;
-        k = new Key(-priceBuy, timeBuy);
-        v = new Value(numTrade, idBuy);
-        buyTrade = new Elem(k, v);
-        numRemain = numBuy-numSell;
-        // add leftover buys as a new order
-        if (numRemain > 0) buyAux(numRemain, priceBuy, idBuy, timeBuy);
+ReplayPipeline::write() {
+    OutputBuffer out(file);
+    bool last = false;
+    while (!last) {
+        LineBatch* batch = take(matched);
+        if (!quiet) {
+            size_t echoStart = 0;
+            size_t printStart = 0;
+            for (size_t i = 0; i < batch->commands.size(); i++) {
+                out.write(batch->echo.data() + echoStart, batch->echoEnds[i] - echoStart);
+                out.write(batch->printed.data() + printStart, batch->printEnds[i] - printStart);
+                echoStart = batch->echoEnds[i];
+                printStart = batch->printEnds[i];
+            }
+        }
+        last = batch->last;
+        batch->clear();
+        give(recycled, batch);
     }
-    else {
-        numTrade = numBuy;
-        buyTrade = buyLimitOrder;
-        k = new Key(priceSell,timeSell);
-        v = new Value(numTrade, idSell);
-        sellTrade = new Elem(k, v);
-        numRemain = numSell - numBuy;
-        // add leftover sells as a new order
-        if (numRemain > 0) sellAux(numRemain, priceSell, idSell, timeSell);
+}
+
+// INPUT: a stock market M (single-threaded or sharded)
+// POSTCONDITION: the input is replayed on M exactly as replay does, with the same output
+template <typename Market>
+void
+ReplayPipeline::run(Market& M) {
+    Clock::time_point start = Clock::now();
+    output.flush();
+    thread parser(&ReplayPipeline::parse, this);
+    thread writer(&ReplayPipeline::write, this);
+    vector<int> symbolIds(1, 0);  // the market's ID of each symbol ID of the parser
+    bool last = false;
+    while (!last) {
+        LineBatch* batch = take(parsed);
+        for (size_t i = 0; i < batch->symbols.size(); i++) {
+            const string& name = batch->symbols[i];
+            symbolIds.push_back(M.symbolTable().intern(name.data(), name.data() + name.size()));
+        }
+        output.capture(&batch->printed);
+        for (size_t i = 0; i < batch->commands.size(); i++) {
+            Command& c = batch->commands[i];
+            if (c.symbol > 0) c.symbol = symbolIds[c.symbol];
+            runCommand(M, c);
+            // limit orders print nothing; an immediate one may be rejected by a call auction
+            if ((c.type != CMD_BUY && c.type != CMD_SELL) || c.orderType != LIMIT_ORDER) output.flush();
+            batch->printEnds.push_back(batch->printed.size());
+        }
+        output.capture(NULL);
+        last = batch->last;
+        give(matched, batch);
     }
-    books.buy(buyTrade);
-    books.sell(sellTrade);
-    bank += priceDiff * numTrade;
+    parser.join();
+    writer.join();
+    if (quiet) printSummary(M, start);
 }
 
-// POSTCONDITION: all possible trades are processed/executed and recorded/documented, the market's limit-order books are properly updated/maintained, and the market profit from the respective trades (if any) is updated/increased
+// Benchmarks: run with "Main --bench <name> [args]" instead of processing the input file
+
+// INPUT: number of orders n, output vector orders (passed by ref) and a random seed
+// POSTCONDITION: orders holds n sell orders with random prices around 100.00, random sizes and
+// increasing time stamps
 void
-StockMarket::trade() {
-    if (buyOrders.empty() || sellOrders.empty()) return;
-    bool tradeAvail = true;
-    while (tradeAvail && !(buyOrders.empty() || sellOrders.empty())) {
-        Elem* buyLimitOrder = buyOrders.min();
-        Elem* sellLimitOrder = sellOrders.min();
-    
-        double buyPrice = -buyLimitOrder->key->price;
-        double sellPrice = sellLimitOrder->key->price;
+randomOrders(int n, vector<Order>& orders, unsigned seed) {
+    mt19937 gen(seed);
+    uniform_int_distribution<int> cents(-200, 200);
+    uniform_int_distribution<int> shares(1, 1200);
+    uniform_int_distribution<int> trader(0, 9);
+    orders.clear();
+    orders.reserve(n);
+    for (int t = 0; t < n; t++)
+        orders.push_back(Order(Key(priceToTicks(100.0) + cents(gen), t), Value(shares(gen), trader(gen))));
+}
+
+// INPUT: the largest number of resting orders to benchmark
+// POSTCONDITION: insert and removeMin throughput of ArrayHeap is sent to cout for
+// book sizes 1e3, 1e4, ... up to maxN
+void
+benchHeap(int maxN) {
+    cout << "orders,queue,insert Mops/s,removeMin Mops/s" << endl;
+    vector<Order> orders;
+    for (int n = 1000; n <= maxN; n *= 10) {
+        randomOrders(n, orders, n);
+        long long check = 0;
+        for (int i = 0; i < n; i++) check += orders[i].timeStamp();
+        ArrayHeap H;
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < n; i++)
+            H.insert(orders[i]);
+        double tInsert = secondsSince(start);
+        start = Clock::now();
+        while (!H.empty()) {
+            check -= H.min()->timeStamp();
+            H.removeMin();
+        }
+        double tRemove = secondsSince(start);
+        cout << n << ",ArrayHeap," << n / tInsert / 1e6 << "," << n / tRemove / 1e6 << endl;
+        if (check != 0) cout << "checksum mismatch" << endl;
+    }
+}
 
-        double marketSpread = sellPrice - buyPrice;
+// INPUT: the number of small aggressive buy orders
+// POSTCONDITION: fills per second are sent to cout for each engine when a single large resting
+// sell order (the whale) is hit by n small buy orders (the minnows), each partially filling it
+void
+benchWhale(int n) {
+    cout << "engine,fills,fills/s" << endl;
+    Engine engines[] = { HEAP_ENGINE, LEVEL_ENGINE };
+    const char* names[] = { "heap", "levels" };
+    for (int e = 0; e < 2; e++) {
+        StockMarket M(engines[e]);
+        // a resting book behind the whale so the queues are not trivially small
+        for (int i = 0; i < 10000; i++) M.sell(priceToTicks(101.0) + i % 100, 100, i % 10);
+        M.sell(priceToTicks(100.0), 2 * n, 0);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < n; i++) M.buy(priceToTicks(100.0), 1 + i % 2, 1 + i % 9);
+        double t = secondsSince(start);
+        cout << names[e] << "," << n << "," << n / t << endl;
+    }
+}
 
-        // process trades if lowest sell <= highest buy
-        tradeAvail = (marketSpread <= 0.0);
-        if (tradeAvail) processTrade();
+// INPUT: the number of orders n
+// POSTCONDITION: the orders per second of the matching loop for each engine is sent to cout, on
+// crossing flow alternating buys and sells around the same mid
+void
+benchMatch(int n) {
+    vector<Order> orders;
+    randomOrders(n, orders, 2);
+    cout << "engine,orders,orders/s" << endl;
+    Engine engines[] = { HEAP_ENGINE, LEVEL_ENGINE };
+    const char* names[] = { "heap", "levels" };
+    for (int e = 0; e < 2; e++) {
+        StockMarket M(engines[e]);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < n; i++) {
+            const Order& o = orders[i];
+            if (i % 2) M.buy(o.price(), o.value.numShares, o.value.traderID);
+            else M.sell(o.price(), o.value.numShares, o.value.traderID);
+        }
+        cout << names[e] << "," << n << "," << n / secondsSince(start) << endl;
     }
 }
 
-int main() {
-    string inputFilename = "input.txt";
-    string line;
+// key with a floating-point price, as used before prices were fixed-point ticks
+struct DoubleKey {
+    double price;
+    int timeStamp;
+};
 
-    StockMarket M;
-    // open input file
-    fstream inputFile;
-    loadFile(inputFilename, inputFile);
-    while (getline(inputFile, line))
+bool
+operator < (const DoubleKey &x, const DoubleKey &y) {
+    return ((x.price < y.price) || ((x.price == y.price) && (x.timeStamp < y.timeStamp)));
+}
+
+// INPUT: the number of keys n
+// POSTCONDITION: the time taken to sort n random keys with the floating-point, tick-based and
+// packed key comparators, and the comparisons per second, are sent to cout
+void
+benchCompare(int n) {
+    vector<Order> orders;
+    randomOrders(n, orders, 3);
+    vector<Key> keys(n);
+    vector<DoubleKey> doubleKeys(n);
+    vector<PackedKey> packedKeys(n);
+    for (int i = 0; i < n; i++) {
+        // shuffle time stamps so that ties on price are broken in both directions
+        keys[i] = Key(orders[i].price(), (int) ((i * 2654435761u) % n));
+        doubleKeys[i].price = ticksToPrice(keys[i].price);
+        doubleKeys[i].timeStamp = keys[i].timeStamp;
+        packedKeys[i] = packKey(keys[i]);
+    }
+    long long compares = 0;
+    cout << "key,seconds,compares/s" << endl;
+    Clock::time_point start = Clock::now();
+    sort(doubleKeys.begin(), doubleKeys.end(), [&compares](const DoubleKey& x, const DoubleKey& y) {
+        compares++;
+        return x < y;
+    });
+    double t = secondsSince(start);
+    cout << "double," << t << "," << compares / t << endl;
+    compares = 0;
+    start = Clock::now();
+    sort(keys.begin(), keys.end(), [&compares](const Key& x, const Key& y) {
+        compares++;
+        return x < y;
+    });
+    t = secondsSince(start);
+    cout << "ticks," << t << "," << compares / t << endl;
+    compares = 0;
+    start = Clock::now();
+    sort(packedKeys.begin(), packedKeys.end(), [&compares](PackedKey x, PackedKey y) {
+        compares++;
+        return x < y;
+    });
+    t = secondsSince(start);
+    cout << "packed," << t << "," << compares / t << endl;
+}
+
+// INPUT: an input line
+// OUTPUT: the command on the line, parsed as main used to: a stringstream split into a vector of
+// trimmed string tokens, then stoi on the numbers
+Command
+parseCommandStream(const string& line) {
+    Command c;
+    stringstream lineSS(line);
+    string token;
+    vector<string> tokens;
+    while (getline(lineSS, token, ' ')) {
+        token.erase(token.find_last_not_of(" \n\r\t") + 1);
+        if (token.length() > 0) tokens.push_back(token);
+    }
+    if (tokens.size() == 4 && (tokens[0] == "buy" || tokens[0] == "sell")) {
+        c.type = (tokens[0] == "buy") ? CMD_BUY : CMD_SELL;
+        c.num = stoi(tokens[1]);
+        if (!parsePrice(tokens[2], c.price)) c.type = CMD_INVALID;
+        c.id = stoi(tokens[3]);
+    }
+    else if (tokens.size() > 0 && tokens[0] == "print") c.type = CMD_PRINT;
+    return c;
+}
+
+// INPUT: the number of lines n and the name of a scratch file
+// POSTCONDITION: a file of n buy/sell/print lines is written, parsed with the stream-based and the
+// block-reading parsers, and the lines per second of each are sent to cout; the file is removed
+void
+benchParse(int n, const string& fname) {
+    vector<Order> orders;
+    randomOrders(n, orders, 4);
     {
-        // trim whitespace
-        // echo input
-        cout << line << endl;
-        // parse input using a stringstream
-        stringstream lineSS(line);
-        string token;
-        string command = "";
-        // store tokens in a vector
-        vector<string> tokens;
-        while (getline(lineSS, token, ' '))
-        {
-            // trim whitespace
-            token.erase(token.find_last_not_of(" \n\r\t") + 1);
-            if (token.length() > 0)
-            {
-                tokens.push_back(token);
+        ofstream out(fname.c_str());
+        for (int i = 0; i < n; i++) {
+            if (i % 50 == 49) out << "print buy\n";
+            else out << ((i % 2) ? "buy " : "sell ") << orders[i].value.numShares << " "
+                     << fixed << setprecision(2) << ticksToPrice(orders[i].price()) << " "
+                     << orders[i].value.traderID << "\n";
+        }
+    }
+    cout << "parser,lines,lines/s" << endl;
+    long long check = 0;
+    {
+        Clock::time_point start = Clock::now();
+        ifstream in(fname.c_str());
+        string line;
+        int lines = 0;
+        while (getline(in, line)) {
+            Command c = parseCommandStream(line);
+            check += c.num + c.price + c.id;
+            lines++;
+        }
+        cout << "stream," << lines << "," << lines / secondsSince(start) << endl;
+    }
+    {
+        Clock::time_point start = Clock::now();
+        LineReader in;
+        in.open(fname);
+        SymbolTable symbols;
+        const char* b;
+        const char* e;
+        int lines = 0;
+        while (in.nextLine(b, e)) {
+            Command c = parseCommand(b, e, symbols);
+            check -= c.num + c.price + c.id;
+            lines++;
+        }
+        cout << "block," << lines << "," << lines / secondsSince(start) << endl;
+    }
+    if (check != 0) cout << "checksum mismatch" << endl;
+    remove(fname.c_str());
+}
+
+// Parameters of a synthetic order stream
+struct FlowConfig {
+    unsigned seed;
+    int numTraders;
+    double mid;          // initial mid price
+    double volatility;   // standard deviation of the mid's move per order, in ticks
+    double meanShares;   // order sizes are log-normal with this mean ...
+    double sizeSigma;    // ... and this sigma of the underlying normal
+    int maxShares;
+    double buyRatio;     // probability that an order is a buy
+    double crossProb;    // probability that an order is priced through the mid
+    double meanOffset;   // mean distance of an order's price from the mid, in ticks
+    FlowConfig() : seed(1), numTraders(100), mid(100.0), volatility(0.5), meanShares(500.0),
+        sizeSigma(0.8), maxShares(10000), buyRatio(0.5), crossProb(0.2), meanOffset(10.0) { }
+};
+
+// Generator of a reproducible synthetic order stream
+// The mid price follows a random walk; each order rests on its own side of the mid, or with
+// probability crossProb is priced through it, at an exponentially distributed distance.
+class OrderFlow {
+    public:
+        OrderFlow(const FlowConfig& c) : cfg(c), gen(c.seed), mid(priceToTicks(c.mid)), drift(0.0),
+            uniform(0.0, 1.0), step(0.0, c.volatility), offset(1.0 / c.meanOffset),
+            size(log(c.meanShares) - c.sizeSigma * c.sizeSigma / 2, c.sizeSigma),
+            trader(0, c.numTraders - 1) { }
+
+        Command next();
+
+    private:
+        FlowConfig cfg;
+        mt19937_64 gen;
+        Ticks mid;
+        double drift;  // fractional ticks of the mid's random walk
+        uniform_real_distribution<double> uniform;
+        normal_distribution<double> step;
+        exponential_distribution<double> offset;
+        lognormal_distribution<double> size;
+        uniform_int_distribution<int> trader;
+};
+
+// OUTPUT: the next buy or sell command of the stream
+Command
+OrderFlow::next() {
+    drift += step(gen);
+    Ticks move = (Ticks) drift;
+    mid += move;
+    drift -= move;
+    if (mid < 1) mid = 1;
+
+    Command c;
+    bool isBuy = uniform(gen) < cfg.buyRatio;
+    bool crosses = uniform(gen) < cfg.crossProb;
+    Ticks distance = 1 + (Ticks) offset(gen);
+    c.type = (isBuy) ? CMD_BUY : CMD_SELL;
+    // buys rest below the mid and sells above it, unless the order crosses
+    c.price = (isBuy != crosses) ? mid - distance : mid + distance;
+    if (c.price < 1) c.price = 1;
+    double shares = size(gen);
+    c.num = (shares < 1.0) ? 1 : (shares > cfg.maxShares) ? cfg.maxShares : (int) shares;
+    c.id = trader(gen);
+    return c;
+}
+
+// INPUT: a stock market M and a buy or sell command c
+// OUTPUT: the ID of the order placed on M
+int
+runOrder(StockMarket& M, const Command& c) {
+    if (c.type == CMD_BUY) return M.buy(c.price, c.num, c.id);
+    return M.sell(c.price, c.num, c.id);
+}
+
+// INPUT: a sorted vector of latencies and a fraction q
+// OUTPUT: the q-quantile of the latencies
+long long
+quantile(const vector<long long>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t i = (size_t) (q * (sorted.size() - 1));
+    return sorted[i];
+}
+
+// INPUT: the name of a scenario, its order-stream parameters and the number of orders n
+// POSTCONDITION: the stream is fed to a market for each engine, and the orders per second,
+// trades per second and the p50/p99/p99.9 latency of single orders are sent to cout
+void
+benchFlowScenario(const string& name, const FlowConfig& cfg, int n) {
+    vector<Command> commands;
+    commands.reserve(n);
+    OrderFlow flow(cfg);
+    for (int i = 0; i < n; i++) commands.push_back(flow.next());
+
+    Engine engines[] = { HEAP_ENGINE, LEVEL_ENGINE };
+    const char* names[] = { "heap", "levels" };
+    vector<long long> latency(n);
+    for (int e = 0; e < 2; e++) {
+        StockMarket M(engines[e]);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < n; i++) {
+            Clock::time_point t0 = Clock::now();
+            runCommand(M, commands[i]);
+            latency[i] = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t0).count();
+        }
+        double seconds = secondsSince(start);
+        sort(latency.begin(), latency.end());
+        cout << name << "," << names[e] << "," << n << "," << (long long) (n / seconds) << ","
+             << (long long) (M.trades() / seconds) << "," << quantile(latency, 0.5) << ","
+             << quantile(latency, 0.99) << "," << quantile(latency, 0.999) << endl;
+    }
+}
+
+// INPUT: the scenario to run ("all" for every scenario), the number of orders n and the seed
+// POSTCONDITION: the end-to-end throughput and latency of each selected scenario is sent to cout
+void
+benchFlow(const string& scenario, int n, unsigned seed) {
+    cout << "scenario,engine,orders,orders/s,trades/s,p50 ns,p99 ns,p99.9 ns" << endl;
+    FlowConfig cfg;
+    cfg.seed = seed;
+    if (scenario == "all" || scenario == "deep") {
+        // a deep resting book: orders rarely cross
+        FlowConfig deep = cfg;
+        deep.crossProb = 0.02;
+        deep.meanOffset = 50.0;
+        deep.volatility = 0.05;
+        benchFlowScenario("deep", deep, n);
+    }
+    if (scenario == "all" || scenario == "crossing") {
+        // constantly crossing flow close to the mid
+        FlowConfig crossing = cfg;
+        crossing.crossProb = 0.6;
+        crossing.meanOffset = 3.0;
+        benchFlowScenario("crossing", crossing, n);
+    }
+    if (scenario == "all" || scenario == "onesided") {
+        // one-sided build-up: mostly buys resting under a rising mid
+        FlowConfig onesided = cfg;
+        onesided.buyRatio = 0.9;
+        onesided.crossProb = 0.05;
+        onesided.volatility = 0.2;
+        benchFlowScenario("onesided", onesided, n);
+    }
+}
+
+// INPUT: the number of orders n
+// POSTCONDITION: for a deep and a constantly crossing order stream and each engine, the stream is
+// run with the legacy matching (every order enters its book first) and with aggressor-first
+// matching, and then again with every other order sent as immediate-or-cancel; orders per
+// second, the speedup over the legacy matching and whether the trades and bank profit match it
+// are sent to cout
+void
+benchAggressor(int n) {
+    FlowConfig deep;
+    deep.crossProb = 0.02;
+    deep.meanOffset = 50.0;
+    deep.volatility = 0.05;
+    FlowConfig crossing;
+    crossing.crossProb = 0.6;
+    crossing.meanOffset = 3.0;
+    FlowConfig configs[] = { deep, crossing };
+    const char* scenarios[] = { "deep", "crossing" };
+    Engine engines[] = { HEAP_ENGINE, LEVEL_ENGINE };
+    const char* names[] = { "heap", "levels" };
+    const char* modes[] = { "legacy", "aggressor", "half ioc" };
+    cout << "scenario,engine,matching,orders,trades,orders/s,speedup,same" << endl;
+    for (int k = 0; k < 2; k++) {
+        vector<Command> commands;
+        commands.reserve(n);
+        OrderFlow flow(configs[k]);
+        for (int i = 0; i < n; i++) commands.push_back(flow.next());
+        for (int e = 0; e < 2; e++) {
+            double base = 0;
+            long long baseTrades = 0;
+            Ticks baseBank = 0;
+            for (int m = 0; m < 3; m++) {
+                StockMarket M(engines[e]);
+                M.matchAfterResting(m == 0);
+                Clock::time_point start = Clock::now();
+                for (int i = 0; i < n; i++) {
+                    Command c = commands[i];
+                    if (m == 2 && i % 2) c.orderType = IOC_ORDER;
+                    runCommand(M, c);
+                }
+                double rate = n / secondsSince(start);
+                if (m == 0) {
+                    base = rate;
+                    baseTrades = M.trades();
+                    baseBank = M.getBank();
+                }
+                // immediate-or-cancel orders never rest, so they do not trade like limit orders
+                bool same = (M.trades() == baseTrades && M.getBank() == baseBank);
+                cout << scenarios[k] << "," << names[e] << "," << modes[m] << "," << n << ","
+                     << M.trades() << "," << (long long) rate << "," << fixed << setprecision(2)
+                     << rate / base << "," << ((m == 2) ? "-" : (same) ? "yes" : "NO") << endl;
             }
         }
-        if (tokens.size() > 0)
-        {
-            command = tokens[0]; // first token is the command
+    }
+}
+
+// INPUT: the number of orders n in the batch
+// POSTCONDITION: for each engine, a batch of orders crossing around a common mid is fed through
+// continuous matching and through a call auction (collected without matching, then uncrossed in
+// one pass); the orders per second (including the uncross), the time of the uncross alone, and
+// the trades and resting orders left are sent to cout
+void
+benchAuction(int n) {
+    FlowConfig cfg;
+    cfg.crossProb = 0.5;
+    cfg.meanOffset = 5.0;
+    cfg.volatility = 0.0;
+    vector<Command> commands;
+    commands.reserve(n);
+    OrderFlow flow(cfg);
+    for (int i = 0; i < n; i++) commands.push_back(flow.next());
+
+    Engine engines[] = { HEAP_ENGINE, LEVEL_ENGINE };
+    const char* names[] = { "heap", "levels" };
+    cout << "engine,mode,orders,trades,resting,orders/s,uncross ms" << endl;
+    for (int e = 0; e < 2; e++) {
+        for (int mode = 0; mode < 2; mode++) {
+            StockMarket M(engines[e]);
+            Clock::time_point start = Clock::now();
+            if (mode == 1) M.beginAuction();
+            for (int i = 0; i < n; i++) runCommand(M, commands[i]);
+            Clock::time_point collected = Clock::now();
+            if (mode == 1) M.endAuction();
+            double seconds = secondsSince(start);
+            double uncross = (mode == 1) ? secondsSince(collected) * 1e3 : 0.0;
+            cout << names[e] << "," << ((mode == 1) ? "auction" : "continuous") << "," << n << ","
+                 << M.trades() << "," << M.resting() << "," << (long long) (n / seconds) << ","
+                 << fixed << setprecision(3) << uncross << endl;
         }
-        if (tokens.size() == 1)
-        {
-            if (command == "print")
-            {
-                M.print();
+    }
+}
+
+// INPUT: the number of new orders n and the cancel ratio, the fraction of orders that are cancelled
+// POSTCONDITION: for each engine, a deep-book order stream in which each new order is followed,
+// with probability cancelRatio, by a cancel of a random earlier order (possibly already filled) is
+// run; operations (orders and cancels) per second and cancel latency are sent to cout
+void
+benchCancel(int n, double cancelRatio) {
+    FlowConfig cfg;
+    cfg.crossProb = 0.02;
+    cfg.meanOffset = 50.0;
+    cfg.volatility = 0.05;
+    cout << "engine,operations,cancels,resting,operations/s,cancel p50 ns,cancel p99 ns,cancel p99.9 ns" << endl;
+    Engine engines[] = { HEAP_ENGINE, LEVEL_ENGINE };
+    const char* names[] = { "heap", "levels" };
+    for (int e = 0; e < 2; e++) {
+        // build a resting book first so cancels hit a realistically deep book
+        StockMarket M(engines[e]);
+        OrderFlow flow(cfg);
+        mt19937 gen(7);
+        uniform_real_distribution<double> uniform(0.0, 1.0);
+        vector<int> live;
+        for (int i = 0; i < 100000; i++) live.push_back(runOrder(M, flow.next()));
+        vector<long long> latency;
+        latency.reserve(n);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < n; i++) {
+            live.push_back(runOrder(M, flow.next()));
+            if (uniform(gen) < cancelRatio) {
+                size_t k = gen() % live.size();
+                int orderId = live[k];
+                live[k] = live.back();
+                live.pop_back();
+                Clock::time_point t0 = Clock::now();
+                M.cancel(orderId);
+                latency.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t0).count());
             }
         }
-        if (tokens.size() > 1)
+        double seconds = secondsSince(start);
+        sort(latency.begin(), latency.end());
+        long long operations = n + (long long) latency.size();
+        cout << names[e] << "," << operations << "," << latency.size() << "," << M.resting() << ","
+             << (long long) (operations / seconds) << "," << quantile(latency, 0.5) << ","
+             << quantile(latency, 0.99) << "," << quantile(latency, 0.999) << endl;
+    }
+}
+
+// INPUT: the number of fills n
+// POSTCONDITION: n fills between random traders, first with dense trader IDs (1000 traders) and then
+// with sparse ones (1000 traders with random 31-bit IDs), are recorded in the ledger; fills per
+// second and bytes per million fills are sent to cout
+void
+benchLedger(int n) {
+    cout << "traders,ledger,fills,fills/s,bytes per 1M fills" << endl;
+    mt19937 gen(11);
+    uniform_int_distribution<int> cents(-200, 200);
+    uniform_int_distribution<int> shares(1, 1000);
+    vector<int> sparseIds(1000);
+    for (size_t i = 0; i < sparseIds.size(); i++) sparseIds[i] = (int) (gen() >> 1);
+    vector<Fill> fills(n);
+    for (int sparse = 0; sparse <= 1; sparse++) {
+        for (int i = 0; i < n; i++) {
+            Ticks price = priceToTicks(100.0) + cents(gen);
+            int buyer = gen() % 1000;
+            int seller = gen() % 1000;
+            Fill f = { i, 0, Key(-price, 2 * i), Key(price, 2 * i + 1), shares(gen),
+                       (sparse) ? sparseIds[buyer] : buyer, (sparse) ? sparseIds[seller] : seller };
+            fills[i] = f;
+        }
+        const char* traders = (sparse) ? "sparse," : "dense,";
+        double perMillion = 1e6 / n;
         {
-            if (command == "buy") // buy # shares @ specific price, id
-            {
-                M.buy(stof(tokens[2]), stoi(tokens[1]), stoi(tokens[3]));
+            Ledger L;
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < n; i++) {
+                const Fill& f = fills[i];
+                L.buy(f.buyKey, Value(f.numShares, f.idBuy));
+                L.sell(f.sellKey, Value(f.numShares, f.idSell));
             }
-            if (command == "sell") // sell # shares @ specific price, id
-            {
-                M.sell(stof(tokens[2]), stoi(tokens[1]), stoi(tokens[3]));
+            double seconds = secondsSince(start);
+            cout << traders << "flat," << n << "," << (long long) (n / seconds) << ","
+                 << (long long) (L.bytes() * perMillion) << endl;
+        }
+    }
+}
+
+// INPUT: the largest number of resting orders n
+// POSTCONDITION: for books of 1000 orders up to n, growing tenfold, the top 10 levels per side are
+// printed from the depth ("print depth 10") and from the whole books ("print buy" and "print
+// sell"), into memory; the number of resting orders and the time per print are sent to cout
+void
+benchDepth(int n) {
+    FlowConfig cfg;
+    cfg.crossProb = 0.0;
+    cout << "resting,depth us/print,books us/print,speedup" << endl;
+    string printed;
+    for (int size = 1000; size <= n; size *= 10) {
+        StockMarket M;
+        OrderFlow flow(cfg);
+        for (int i = 0; i < size; i++) {
+            Command c = flow.next();
+            runCommand(M, c);
+        }
+        int reps = max(3, 1000000 / size);
+        output.capture(&printed);
+        Clock::time_point start = Clock::now();
+        for (int r = 0; r < 100000; r++) {
+            printed.clear();
+            M.printDepth(10);
+        }
+        double depthSeconds = secondsSince(start) / 100000;
+        start = Clock::now();
+        for (int r = 0; r < reps; r++) {
+            printed.clear();
+            M.printBuy();
+            M.printSell();
+        }
+        double booksSeconds = secondsSince(start) / reps;
+        output.capture(NULL);
+        cout << M.resting() << "," << fixed << setprecision(2) << depthSeconds * 1e6
+             << "," << booksSeconds * 1e6 << "," << setprecision(0) << booksSeconds / depthSeconds
+             << endl;
+    }
+}
+
+// INPUT: the largest number of fills n
+// POSTCONDITION: for ledgers of 10000 fills up to n, growing tenfold, among 1000 traders, the time
+// of a profit and loss query for one trader ("print pnl <id>") and for all of them ("print pnl"),
+// which read the statistics kept as the fills are recorded, and of a ledger print, which walks every
+// transaction as recomputing the statistics would, are sent to cout; the output goes to memory
+void
+benchPnl(int n) {
+    cout << "fills,pnl one us,pnl all us,ledger print us" << endl;
+    SymbolTable symbols;
+    string printed;
+    mt19937 gen(11);
+    uniform_int_distribution<int> cents(-200, 200);
+    uniform_int_distribution<int> shares(1, 1000);
+    for (int size = 10000; size <= n; size *= 10) {
+        Ledger L;
+        for (int i = 0; i < size; i++) {
+            Ticks price = priceToTicks(100.0) + cents(gen);
+            L.buy(Key(-price, 2 * i), Value(shares(gen), gen() % 1000));
+            L.sell(Key(price, 2 * i + 1), Value(shares(gen), gen() % 1000));
+        }
+        output.capture(&printed);
+        double seconds[3];
+        for (int q = 0; q < 3; q++) {
+            int reps = (q == 0) ? 100000 : (q == 1) ? 1000 : max(3, 1000000 / size);
+            Clock::time_point start = Clock::now();
+            for (int r = 0; r < reps; r++) {
+                printed.clear();
+                if (q == 0) L.printPnl(symbols, false, r % 1000);
+                else if (q == 1) L.printPnl(symbols, true);
+                else L.print(symbols);
             }
-            if (command == "print")
-            {
-                if (tokens[1] == "buy")
-                {
-                    M.printBuy();
-                }
-                if (tokens[1] == "sell")
-                {
-                    M.printSell();
-                }
-                if (tokens[1] == "ledger")
-                {
-                    M.printLedger();
-                }
-                if (tokens[1] == "bank")
-                {
-                    M.printBank();
-                }
+            seconds[q] = secondsSince(start) / reps;
+        }
+        output.capture(NULL);
+        cout << size << "," << fixed << setprecision(2) << seconds[0] * 1e6 << "," << seconds[1] * 1e6
+             << "," << seconds[2] * 1e6 << endl;
+    }
+}
+
+// INPUT: the number of orders n
+// POSTCONDITION: a constantly crossing order stream is run with the ledger recorded on the
+// matching thread and on a ledger thread; orders per second (including the final ledger flush)
+// and the p50/p99/p99.9 latency of single orders are sent to cout
+void
+benchLedgerThread(int n) {
+    FlowConfig cfg;
+    cfg.crossProb = 0.6;
+    cfg.meanOffset = 3.0;
+    vector<Command> commands;
+    commands.reserve(n);
+    OrderFlow flow(cfg);
+    for (int i = 0; i < n; i++) commands.push_back(flow.next());
+
+    cout << "ledger,orders,trades,orders/s,p50 ns,p99 ns,p99.9 ns,bank" << endl;
+    const char* names[] = { "sync", "thread" };
+    vector<long long> latency(n);
+    for (int k = 0; k < 2; k++) {
+        StockMarket M;
+        if (k == 1) M.startLedgerThread();
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < n; i++) {
+            Clock::time_point t0 = Clock::now();
+            runCommand(M, commands[i]);
+            latency[i] = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t0).count();
+        }
+        M.flushLedger();
+        double seconds = secondsSince(start);
+        sort(latency.begin(), latency.end());
+        cout << names[k] << "," << n << "," << M.trades() << "," << (long long) (n / seconds) << ","
+             << quantile(latency, 0.5) << "," << quantile(latency, 0.99) << ","
+             << quantile(latency, 0.999) << "," << fixed << setprecision(2)
+             << ticksToPrice(M.getBank()) << endl;
+    }
+}
+
+// INPUT: the number of lines n and the name of a scratch file
+// POSTCONDITION: a replay of n lines of synthetic orders, with a "print bank" every 1000 lines, is
+// run with echo by the sequential loop and by the pipeline, with the output going to scratch
+// files; lines per second, the speedup and whether the two outputs are identical are sent to cout
+void
+benchPipeline(int n, const string& fname) {
+    {
+        ofstream out(fname.c_str());
+        OrderFlow flow((FlowConfig()));
+        for (int i = 0; i < n; i++) {
+            if (i % 1000 == 999) {
+                out << "print bank\n";
+                continue;
+            }
+            Command c = flow.next();
+            out << ((c.type == CMD_BUY) ? "buy " : "sell ") << c.num << " " << fixed
+                << setprecision(2) << ticksToPrice(c.price) << " " << c.id << "\n";
+        }
+    }
+    string outNames[] = { fname + ".sequential", fname + ".pipeline" };
+    double rates[2];
+    for (int k = 0; k < 2; k++) {
+        FILE* f = fopen(outNames[k].c_str(), "w");
+        LineReader in;
+        in.open(fname);
+        StockMarket M;
+        Clock::time_point start = Clock::now();
+        if (k == 0) {
+            output.redirect(f);
+            replay(M, in, false);
+            output.redirect(stdout);
+        }
+        else ReplayPipeline(in, f, false).run(M);
+        fclose(f);
+        rates[k] = n / secondsSince(start);
+    }
+    ifstream a(outNames[0].c_str(), ios::binary);
+    ifstream b(outNames[1].c_str(), ios::binary);
+    bool same = equal(istreambuf_iterator<char>(a), istreambuf_iterator<char>(),
+                      istreambuf_iterator<char>(b), istreambuf_iterator<char>());
+    cout << "mode,lines,lines/s,speedup,same output" << endl;
+    cout << "sequential," << n << "," << (long long) rates[0] << ",1.00,yes" << endl;
+    cout << "pipeline," << n << "," << (long long) rates[1] << "," << fixed << setprecision(2)
+         << rates[1] / rates[0] << "," << ((same) ? "yes" : "NO") << endl;
+    remove(fname.c_str());
+    remove(outNames[0].c_str());
+    remove(outNames[1].c_str());
+}
+
+// INPUT: the number of orders n and the number of symbols
+// POSTCONDITION: an order stream spread uniformly over the symbols (each with its own synthetic
+// flow) is run on a single-threaded market and on sharded markets with 1, 2, 4, 8 and 16 worker
+// threads; orders per second, the speedup over the single-threaded market and whether the trades
+// and bank profit match it are sent to cout
+void
+benchShards(int n, int numSymbols) {
+    SymbolTable symbols;
+    vector<OrderFlow> flows;
+    for (int s = 0; s < numSymbols; s++) {
+        string name = "S" + to_string(s);
+        symbols.intern(name.data(), name.data() + name.size());
+        FlowConfig cfg;
+        cfg.seed = s + 1;
+        flows.push_back(OrderFlow(cfg));
+    }
+    vector<Command> commands;
+    commands.reserve(n);
+    mt19937 gen(3);
+    for (int i = 0; i < n; i++) {
+        int s = 1 + gen() % numSymbols;
+        commands.push_back(flows[s - 1].next());
+        commands.back().symbol = s;
+    }
+
+    cout << "threads,orders,trades,orders/s,speedup,same" << endl;
+    StockMarket single;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < n; i++) runCommand(single, commands[i]);
+    double base = n / secondsSince(start);
+    cout << "single," << n << "," << single.trades() << "," << (long long) base << ",1.00,yes" << endl;
+    int threads[] = { 1, 2, 4, 8, 16 };
+    for (int k = 0; k < 5; k++) {
+        ShardedMarket M(threads[k]);
+        start = Clock::now();
+        for (int i = 0; i < n; i++) runCommand(M, commands[i]);
+        long long trades = M.trades();
+        double rate = n / secondsSince(start);
+        bool same = (trades == single.trades() && M.getBank() == single.getBank());
+        cout << threads[k] << "," << n << "," << trades << "," << (long long) rate << ","
+             << fixed << setprecision(2) << rate / base << "," << ((same) ? "yes" : "NO") << endl;
+    }
+}
+
+// INPUT: a stock market M and an open input file
+// POSTCONDITION: the buy, sell, cancel and modify commands of the file are executed on M
+void
+replayOrders(StockMarket& M, LineReader& input) {
+    const char* b;
+    const char* e;
+    while (input.nextLine(b, e)) {
+        Command c = parseCommand(b, e, M.symbolTable());
+        if (c.type == CMD_BUY || c.type == CMD_SELL || c.type == CMD_CANCEL || c.type == CMD_MODIFY)
+            runCommand(M, c);
+    }
+}
+
+// INPUT: the number of orders n and the name of the temporary input file
+// POSTCONDITION: a text input of n orders, with a cancel after every 4th order and a modify after
+// every 10th, is run on a market, then run again writing an event log, and the market is
+// restored from the log; the time of each, the size of the input and the log, and whether the
+// restored market has the same trades, bank profit and resting orders are sent to cout
+void
+benchEventLog(int n, const string& fname) {
+    {
+        ofstream out(fname.c_str());
+        OrderFlow flow((FlowConfig()));
+        mt19937 gen(11);
+        int orders = 0;  // order IDs below this one are taken
+        for (int i = 0; i < n; i++) {
+            Command c = flow.next();
+            out << ((c.type == CMD_BUY) ? "buy " : "sell ") << c.num << " " << fixed
+                << setprecision(2) << ticksToPrice(c.price) << " " << c.id << "\n";
+            orders++;
+            if (i % 4 == 3) out << "cancel " << gen() % orders << "\n";
+            if (i % 10 == 9)
+                out << "modify " << gen() % orders << " " << 1 + c.num / 2 << " " << fixed
+                    << setprecision(2) << ticksToPrice(c.price) << "\n";
+        }
+    }
+    string logName = fname + ".log";
+    StockMarket text;
+    LineReader in;
+    in.open(fname);
+    Clock::time_point start = Clock::now();
+    replayOrders(text, in);
+    double textSeconds = secondsSince(start);
+
+    StockMarket logged;
+    LineReader again;
+    again.open(fname);
+    EventLog log;
+    log.open(logName);
+    logged.logEvents(&log);
+    start = Clock::now();
+    replayOrders(logged, again);
+    log.close();
+    double loggedSeconds = secondsSince(start);
+
+    StockMarket restored;
+    start = Clock::now();
+    restored.restore(logName);
+    double restoreSeconds = secondsSince(start);
+
+    ifstream input(fname.c_str(), ios::binary | ios::ate);
+    double textMB = input.tellg() / 1e6;
+    double logMB = log.bytes() / 1e6;
+    bool same = (restored.trades() == text.trades() && restored.getBank() == text.getBank() &&
+                 restored.resting() == text.resting() && restored.numOrders() == text.numOrders());
+    cout << "mode,orders,trades,MB,seconds,speedup,same state" << endl;
+    cout << fixed << setprecision(3);
+    cout << "text," << text.numOrders() << "," << text.trades() << "," << textMB << ","
+         << textSeconds << ",1.00,yes" << endl;
+    cout << "text+log," << logged.numOrders() << "," << logged.trades() << "," << logMB << ","
+         << loggedSeconds << "," << setprecision(2) << textSeconds / loggedSeconds << ",yes" << endl;
+    cout << setprecision(3) << "restore," << restored.numOrders() << "," << restored.trades() << ","
+         << logMB << "," << restoreSeconds << "," << setprecision(2)
+         << textSeconds / restoreSeconds << "," << ((same) ? "yes" : "NO") << endl;
+    remove(fname.c_str());
+    remove(logName.c_str());
+}
+
+// INPUT: the number of resting orders n in the book and the name of the temporary book file
+// POSTCONDITION: for each engine, a book of n resting orders that do not cross is built by
+// inserting the orders one at a time and by loading them at once (PriorityQueue::load), both from
+// an array read beforehand; then a market is started from the book file by replaying its lines as
+// orders and by "load book"; the time of each, and whether the books hand out the same orders in
+// the same order, are sent to cout
+void
+benchLoad(int n, const string& fname) {
+    FlowConfig cfg;
+    cfg.crossProb = 0.0;
+    cfg.volatility = 1e-9;  // the mid stays put, so no order crosses
+    vector<Order> buys;
+    vector<Order> sells;
+    {
+        ofstream out(fname.c_str());
+        OrderFlow flow(cfg);
+        for (int t = 0; t < n; t++) {
+            Command c = flow.next();
+            out << ((c.type == CMD_BUY) ? "buy " : "sell ") << c.num << " " << fixed
+                << setprecision(2) << ticksToPrice(c.price) << " " << c.id << "\n";
+            if (c.type == CMD_BUY) buys.push_back(Order(Key(-c.price, t), Value(c.num, c.id)));
+            else sells.push_back(Order(Key(c.price, t), Value(c.num, c.id)));
+        }
+    }
+
+    Engine engines[] = { HEAP_ENGINE, LEVEL_ENGINE };
+    const char* names[] = { "heap", "levels" };
+    cout << "engine,method,orders,seconds,orders/s,speedup,same" << endl;
+    for (int e = 0; e < 2; e++) {
+        PriorityQueue* queues[2][2];
+        double seconds[2];
+        for (int m = 0; m < 2; m++) {
+            queues[m][0] = newPriorityQueue(engines[e]);
+            queues[m][1] = newPriorityQueue(engines[e]);
+            Clock::time_point start = Clock::now();
+            if (m == 0) {
+                for (size_t k = 0; k < buys.size(); k++) queues[m][0]->insert(buys[k]);
+                for (size_t k = 0; k < sells.size(); k++) queues[m][1]->insert(sells[k]);
+            }
+            else {
+                queues[m][0]->load(buys);
+                queues[m][1]->load(sells);
+            }
+            seconds[m] = secondsSince(start);
+        }
+        bool same = true;
+        for (int side = 0; side < 2; side++) {
+            while (!queues[0][side]->empty() && !queues[1][side]->empty()) {
+                if (queues[0][side]->min()->sortKey != queues[1][side]->min()->sortKey) same = false;
+                queues[0][side]->removeMin();
+                queues[1][side]->removeMin();
+            }
+            if (!queues[0][side]->empty() || !queues[1][side]->empty()) same = false;
+        }
+        for (int m = 0; m < 2; m++) {
+            cout << names[e] << "," << ((m == 0) ? "insert" : "load") << "," << n << "," << fixed
+                 << setprecision(3) << seconds[m] << "," << (long long) (n / seconds[m]) << ","
+                 << setprecision(2) << seconds[0] / seconds[m] << "," << ((same) ? "yes" : "NO") << endl;
+            delete queues[m][0];
+            delete queues[m][1];
+        }
+    }
+
+    double startup[2];
+    int resting[2];
+    for (int m = 0; m < 2; m++) {
+        StockMarket M;
+        Clock::time_point start = Clock::now();
+        if (m == 0) {
+            LineReader in;
+            in.open(fname);
+            replayOrders(M, in);
+        }
+        else M.loadBook(fname);
+        startup[m] = secondsSince(start);
+        resting[m] = M.resting();
+    }
+    for (int m = 0; m < 2; m++)
+        cout << "market," << ((m == 0) ? "replay orders" : "load book") << "," << n << "," << fixed
+             << setprecision(3) << startup[m] << "," << (long long) (n / startup[m]) << ","
+             << setprecision(2) << startup[0] / startup[m] << ","
+             << ((resting[m] == resting[0]) ? "yes" : "NO") << endl;
+    remove(fname.c_str());
+}
+
+// INPUT: the command-line arguments following "--bench"
+// OUTPUT: EXIT_SUCCESS, or EXIT_FAILURE if the benchmark name is unknown
+int
+runBenchmark(int argc, char* argv[]) {
+    string name = (argc > 0) ? argv[0] : "";
+    if (name == "heap") {
+        benchHeap((argc > 1) ? atoi(argv[1]) : 10000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "whale") {
+        benchWhale((argc > 1) ? atoi(argv[1]) : 1000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "match") {
+        benchMatch((argc > 1) ? atoi(argv[1]) : 1000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "compare") {
+        benchCompare((argc > 1) ? atoi(argv[1]) : 10000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "parse") {
+        benchParse((argc > 1) ? atoi(argv[1]) : 5000000, (argc > 2) ? argv[2] : "bench_parse.txt");
+        return EXIT_SUCCESS;
+    }
+    if (name == "flow") {
+        benchFlow((argc > 1) ? argv[1] : "all", (argc > 2) ? atoi(argv[2]) : 1000000,
+                  (argc > 3) ? atoi(argv[3]) : 1);
+        return EXIT_SUCCESS;
+    }
+    if (name == "eventlog") {
+        benchEventLog((argc > 1) ? atoi(argv[1]) : 2000000, (argc > 2) ? argv[2] : "bench_eventlog.txt");
+        return EXIT_SUCCESS;
+    }
+    if (name == "aggressor") {
+        benchAggressor((argc > 1) ? atoi(argv[1]) : 2000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "pnl") {
+        benchPnl((argc > 1) ? atoi(argv[1]) : 1000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "depth") {
+        benchDepth((argc > 1) ? atoi(argv[1]) : 1000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "load") {
+        benchLoad((argc > 1) ? atoi(argv[1]) : 3000000, (argc > 2) ? argv[2] : "bench_book.txt");
+        return EXIT_SUCCESS;
+    }
+    if (name == "auction") {
+        benchAuction((argc > 1) ? atoi(argv[1]) : 1000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "cancel") {
+        benchCancel((argc > 1) ? atoi(argv[1]) : 1000000, (argc > 2) ? atof(argv[2]) : 0.9);
+        return EXIT_SUCCESS;
+    }
+    if (name == "ledger") {
+        benchLedger((argc > 1) ? atoi(argv[1]) : 5000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "ledgerthread") {
+        benchLedgerThread((argc > 1) ? atoi(argv[1]) : 1000000);
+        return EXIT_SUCCESS;
+    }
+    if (name == "pipeline") {
+        benchPipeline((argc > 1) ? atoi(argv[1]) : 5000000, (argc > 2) ? argv[2] : "bench_pipeline.txt");
+        return EXIT_SUCCESS;
+    }
+    if (name == "shards") {
+        benchShards((argc > 1) ? atoi(argv[1]) : 2000000, (argc > 2) ? atoi(argv[2]) : 64);
+        return EXIT_SUCCESS;
+    }
+    cout << "Unknown benchmark " << name << endl;
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--bench")
+        return runBenchmark(argc - 2, argv + 2);
+
+    // command line: [--engine heap|levels] [--tick <size>] [--threads <n>] [--pipeline]
+    // [--async-ledger] [--ledger-diffs] [--log <file>] [--restore <file>] [--quiet] [input file]
+    // --engine selects the order-book engine (default heap), --tick the price tick size
+    // (default 0.01), --threads the number of worker threads the symbols are sharded over (default
+    // 0: single-threaded), --pipeline parsing and output on threads of their own, --async-ledger
+    // the ledger of a single-threaded market on a thread of its own (a sharded market always has
+    // one), --ledger-diffs "print ledger" printing only the records and transactions changed since
+    // the last ledger print ("print snapshot" prints the whole ledger), --log writing every change
+    // to the books to a binary event log, --restore starting from the state at the end of an event
+    // log instead of an empty market (both single-threaded only), and --quiet a benchmark run
+    // that executes only the buy and sell commands, without echo or prints, and ends with a
+    // summary; the input file defaults to input.txt
+    Engine engine = HEAP_ENGINE;
+    int threads = 0;
+    bool pipelined = false;
+    bool asyncLedger = false;
+    bool ledgerDiffs = false;
+    bool quiet = false;
+    string logFilename;
+    string restoreFilename;
+    string inputFilename = "input.txt";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--engine" && i + 1 < argc) {
+            string name = argv[++i];
+            if (name == "heap") engine = HEAP_ENGINE;
+            else if (name == "levels") engine = LEVEL_ENGINE;
+            else {
+                cout << "Unknown engine " << name << ": it must be heap or levels" << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--tick" && i + 1 < argc) {
+            if (!setTickSize(argv[++i])) {
+                cout << "Invalid tick size " << argv[i] << ": it must be positive, and prices up to "
+                     << MIN_PRICE_RANGE << " must fit in " << MAX_PRICE_TICKS << " ticks" << endl;
+                return EXIT_FAILURE;
             }
         }
-        
+        else if (arg == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (arg == "--pipeline") pipelined = true;
+        else if (arg == "--async-ledger") asyncLedger = true;
+        else if (arg == "--ledger-diffs") ledgerDiffs = true;
+        else if (arg == "--log" && i + 1 < argc) logFilename = argv[++i];
+        else if (arg == "--restore" && i + 1 < argc) restoreFilename = argv[++i];
+        else if (arg == "--quiet") quiet = true;
+        else inputFilename = arg;
+    }
+
+    if (threads > 0 && !(logFilename.empty() && restoreFilename.empty())) {
+        cout << "Event logs need a single-threaded market" << endl;
+        return EXIT_FAILURE;
+    }
+
+    // open input file
+    LineReader input;
+    if (!input.open(inputFilename)) return EXIT_FAILURE;
+    EventLog log;
+    if (!logFilename.empty() && !log.open(logFilename)) return EXIT_FAILURE;
+    if (threads > 0) {
+        ShardedMarket M(threads, engine);
+        M.diffLedger(ledgerDiffs);
+        if (pipelined) ReplayPipeline(input, stdout, quiet).run(M);
+        else replay(M, input, quiet);
+    }
+    else {
+        StockMarket M(engine);
+        if (!logFilename.empty()) M.logEvents(&log);
+        if (!restoreFilename.empty() && !M.restore(restoreFilename)) return EXIT_FAILURE;
+        if (asyncLedger) M.startLedgerThread();
+        M.diffLedger(ledgerDiffs);
+        if (pipelined) ReplayPipeline(input, stdout, quiet).run(M);
+        else replay(M, input, quiet);
     }
-    inputFile.close();
+    output.flush();
     return EXIT_SUCCESS;
 }
 